@@ -1,6 +1,6 @@
 /*
  * Framebuffer Terminal Emulator - Full PTY-based terminal with ANSI support
- * Compile: gcc -o out/fb_term fb_term.c -lm -lutil
+ * Compile: gcc -o out/fb_term fb_term.c -lm -lutil -lpthread
  * Run: sudo ./fb_term /path/to/font.ttf
  */
 
@@ -23,34 +23,248 @@
 #include <utmp.h>
 #include <signal.h>
 #include <time.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define STB_TRUETYPE_IMPLEMENTATION
 #include "fb_truetype.h"
+#include "fb_wcwidth.h"
 
 #define MAX_FONTS 5
 #define MAX_ESCAPE_PARAMS 16
 #define MAX_TERM_COLS 500
 #define MAX_TERM_ROWS 200
+#define FB_MAX_DAMAGE 64
+#define BLEND_LUT_SLOTS 8
+#define MAX_RENDER_THREADS 64
+#define COVERAGE_PAGE_BITS 12  /* 4096 codepoints per coverage page */
+#define COVERAGE_PAGES (0x110000 >> COVERAGE_PAGE_BITS)
 
 /* Render mode */
 #define RENDER_FB   0   /* Direct framebuffer rendering */
 #define RENDER_TERM 1   /* ANSI escape sequences to terminal stdout */
 static int render_mode = RENDER_FB;
 
+/* Cursor shapes, as drawn by the backends */
+#define CURSOR_NONE      0
+#define CURSOR_BLOCK     1
+#define CURSOR_UNDERLINE 2
+#define CURSOR_BAR       3
+#define CURSOR_BLINK_PERIOD 0.53  /* Seconds per blink phase, as xterm */
+
 /* Terminal dimensions - will be calculated dynamically */
 static int TERM_COLS = 80;
 static int TERM_ROWS = 24;
 
+/*
+ * DRM/KMS uapi, the subset used by the dumb-buffer backend. These are
+ * the stable kernel ABI from <drm/drm.h> and <drm/drm_mode.h>, spelled
+ * out so building needs neither libdrm nor the kernel DRM headers.
+ */
+#define DRM_IOCTL_SET_MASTER         _IO('d', 0x1e)
+#define DRM_IOCTL_DROP_MASTER        _IO('d', 0x1f)
+#define DRM_IOCTL_MODE_GETRESOURCES  _IOWR('d', 0xA0, struct drm_mode_card_res)
+#define DRM_IOCTL_MODE_GETCRTC       _IOWR('d', 0xA1, struct drm_mode_crtc)
+#define DRM_IOCTL_MODE_SETCRTC       _IOWR('d', 0xA2, struct drm_mode_crtc)
+#define DRM_IOCTL_MODE_GETENCODER    _IOWR('d', 0xA6, struct drm_mode_get_encoder)
+#define DRM_IOCTL_MODE_GETCONNECTOR  _IOWR('d', 0xA7, struct drm_mode_get_connector)
+#define DRM_IOCTL_MODE_ADDFB         _IOWR('d', 0xAE, struct drm_mode_fb_cmd)
+#define DRM_IOCTL_MODE_RMFB          _IOWR('d', 0xAF, unsigned int)
+#define DRM_IOCTL_MODE_PAGE_FLIP     _IOWR('d', 0xB0, struct drm_mode_crtc_page_flip)
+#define DRM_IOCTL_MODE_CREATE_DUMB   _IOWR('d', 0xB2, struct drm_mode_create_dumb)
+#define DRM_IOCTL_MODE_MAP_DUMB      _IOWR('d', 0xB3, struct drm_mode_map_dumb)
+#define DRM_IOCTL_MODE_DESTROY_DUMB  _IOWR('d', 0xB4, struct drm_mode_destroy_dumb)
+#define DRM_MODE_CONNECTED           1
+#define DRM_MODE_TYPE_PREFERRED      (1 << 3)
+#define DRM_MODE_PAGE_FLIP_EVENT     0x01
+#define DRM_EVENT_FLIP_COMPLETE      0x02
+
+struct drm_mode_card_res {
+    uint64_t fb_id_ptr;
+    uint64_t crtc_id_ptr;
+    uint64_t connector_id_ptr;
+    uint64_t encoder_id_ptr;
+    uint32_t count_fbs;
+    uint32_t count_crtcs;
+    uint32_t count_connectors;
+    uint32_t count_encoders;
+    uint32_t min_width, max_width;
+    uint32_t min_height, max_height;
+};
+
+struct drm_mode_modeinfo {
+    uint32_t clock;
+    uint16_t hdisplay, hsync_start, hsync_end, htotal, hskew;
+    uint16_t vdisplay, vsync_start, vsync_end, vtotal, vscan;
+    uint32_t vrefresh;
+    uint32_t flags;
+    uint32_t type;
+    char name[32];
+};
+
+struct drm_mode_crtc {
+    uint64_t set_connectors_ptr;
+    uint32_t count_connectors;
+    uint32_t crtc_id;
+    uint32_t fb_id;
+    uint32_t x, y;
+    uint32_t gamma_size;
+    uint32_t mode_valid;
+    struct drm_mode_modeinfo mode;
+};
+
+struct drm_mode_get_encoder {
+    uint32_t encoder_id;
+    uint32_t encoder_type;
+    uint32_t crtc_id;
+    uint32_t possible_crtcs;
+    uint32_t possible_clones;
+};
+
+struct drm_mode_get_connector {
+    uint64_t encoders_ptr;
+    uint64_t modes_ptr;
+    uint64_t props_ptr;
+    uint64_t prop_values_ptr;
+    uint32_t count_modes;
+    uint32_t count_props;
+    uint32_t count_encoders;
+    uint32_t encoder_id;
+    uint32_t connector_id;
+    uint32_t connector_type;
+    uint32_t connector_type_id;
+    uint32_t connection;
+    uint32_t mm_width, mm_height;
+    uint32_t subpixel;
+    uint32_t pad;
+};
+
+struct drm_mode_fb_cmd {
+    uint32_t fb_id;
+    uint32_t width, height;
+    uint32_t pitch;
+    uint32_t bpp;
+    uint32_t depth;
+    uint32_t handle;
+};
+
+struct drm_mode_crtc_page_flip {
+    uint32_t crtc_id;
+    uint32_t fb_id;
+    uint32_t flags;
+    uint32_t reserved;
+    uint64_t user_data;
+};
+
+struct drm_mode_create_dumb {
+    uint32_t height, width;
+    uint32_t bpp;
+    uint32_t flags;
+    uint32_t handle;
+    uint32_t pitch;
+    uint64_t size;
+};
+
+struct drm_mode_map_dumb {
+    uint32_t handle;
+    uint32_t pad;
+    uint64_t offset;
+};
+
+struct drm_mode_destroy_dumb {
+    uint32_t handle;
+};
+
+struct drm_event {
+    uint32_t type;
+    uint32_t length;
+};
+
+/* DRM output state of a framebuffer opened with drm_open() */
+struct drm_output {
+    uint32_t crtc_id;
+    uint32_t connector_id;
+    struct drm_mode_modeinfo mode;
+    struct drm_mode_crtc saved_crtc;  /* Restored for the console on close */
+    uint32_t handle[2];               /* Dumb buffers, 0 = not created */
+    uint32_t fb_id[2];
+    uint8_t *map[2];
+    size_t map_size;
+    int flip_pending;                 /* A page flip event is outstanding */
+};
+
+struct fb_rect {
+    int x, y;
+    int w, h;
+};
+
+/* Native pixel for every coverage value of one (fg, bg) color pair */
+struct blend_lut {
+    unsigned format_id;  /* framebuffer format it was built for, 0 = empty */
+    uint32_t fg_color;
+    uint32_t bg_color;
+    uint32_t pixel[256];
+};
+
 struct framebuffer {
     int fd;
     uint8_t *mem;
     size_t mem_size;
     struct fb_var_screeninfo vinfo;
     struct fb_fix_screeninfo finfo;
-    int width;
+    int width;           /* Drawing size, turned by rotate */
     int height;
+    int phys_width;      /* Pixel size of the back buffer and the pages */
+    int phys_height;
+    int rotate;          /* Quarter turns clockwise, as fbcon's rotate */
     int bpp;
     int line_length;
+
+    /* System-RAM back buffer, same layout as the visible part of mem.
+     * All drawing goes here; fb_flush() copies the damaged rectangles
+     * to mem, which is often uncached or write-combined. */
+    uint8_t *back;
+    size_t back_size;
+    struct fb_rect damage[FB_MAX_DAMAGE];
+    int num_damage;
+
+    /* Presentation: with two pages the hidden one is brought up to date
+     * (this frame's damage plus last frame's) and panned to on flush */
+    struct fb_var_screeninfo orig_vinfo;
+    int restore_vinfo;
+    int num_pages;
+    int page;            /* Page currently on screen */
+    struct fb_rect prev_damage[FB_MAX_DAMAGE];
+    int num_prev_damage;
+    int vsync;           /* FBIO_WAITFORVSYNC works */
+    double refresh_period;
+    double pending_since;  /* When the oldest unflushed damage was recorded */
+    unsigned long frames_presented;
+    unsigned long frames_dropped;
+
+    /* Pixel format, resolved once by fb_init_format(). Colors passed to
+     * the blitters are 0x00RRGGBB; fill_span takes a native pixel value
+     * from fb_map_color(). Both operate on already-clipped spans. */
+    int bytes_pp;
+    int red_shift, green_shift, blue_shift;
+    int red_bits, green_bits, blue_bits;
+    void (*fill_span)(struct framebuffer *fb, uint8_t *dst, int width, uint32_t pixel);
+    void (*blit_glyph)(struct framebuffer *fb, uint8_t *dst,
+                       const unsigned char *bitmap, int stride, int width, int height,
+                       uint32_t fg_color, uint32_t bg_color);
+    unsigned format_id;  /* Unique per fb_init_format() call */
+
+    /* Back buffer to fb->mem copy used by fb_flush(), picked by CPU features */
+    void (*copy_span)(uint8_t *dst, const uint8_t *src, size_t len);
+    const char *copy_name;
+
+    /* Set by drm_open(): fd is then the DRM device and the two pages are
+     * dumb buffers flipped with DRM_IOCTL_MODE_PAGE_FLIP. Everything above
+     * the presentation fields is shared with fbdev. */
+    int is_drm;
+    struct drm_output drm;
 };
 
 struct font_entry {
@@ -58,27 +272,153 @@ struct font_entry {
     unsigned char *buffer;
     size_t buffer_size;
     const char *name;
+
+    /* cmap coverage: one bit per codepoint, NULL pages have no glyphs */
+    uint64_t *coverage[COVERAGE_PAGES];
 };
 
-struct cell {
-    uint32_t codepoint;  /* Full Unicode codepoint */
+/*
+ * Cell attributes are interned: a cell holds the index of its attribute
+ * set in a per-terminal table, so a cell is 8 bytes and renderers can
+ * compare attributes with one integer compare.
+ */
+#define MAX_ATTRS      4096
+#define ATTR_HASH_SIZE 8192  /* Power of two, at least twice MAX_ATTRS */
+
+#define ATTR_BOLD      0x01
+#define ATTR_UNDERLINE 0x02
+#define ATTR_INVERSE   0x04
+
+struct attr {
     uint32_t fg_color;
     uint32_t bg_color;
-    int bold;
+    uint32_t flags;  /* ATTR_* */
+};
+
+struct cell {
+    uint32_t codepoint;  /* Full Unicode codepoint */
+    uint32_t attr;       /* Index into the terminal's attrs[] */
+};
+
+/* A wide character takes two cells: its codepoint, then this in the
+ * right one. The two always share attributes and go away together. */
+#define CELL_CONTINUATION 0x110000
+
+/* The last column of a row a wide character wrapped away from. Drawn
+ * and sent as a blank, as every 0 cell is, but left out when the line
+ * is reflowed. */
+#define CELL_WRAP_PAD 0
+
+/*
+ * Scrollback: lines that scrolled off the top of the screen, packed
+ * into a byte ring with a fixed budget. Each line is one record:
+ *
+ *     struct sb_line         header, size covers the whole record
+ *     struct sb_span[]       runs of cells with the same attributes
+ *     char[]                 the codepoints, UTF-8, trailing blanks trimmed;
+ *                            continuations of wide characters are left out
+ *     uint32_t               the size again, for walking backwards
+ *
+ * Spans carry the colors rather than attribute indices, so the attribute
+ * table's sweep never has to look at history. Appending a line evicts
+ * the oldest ones until it fits.
+ */
+#define DEFAULT_SCROLLBACK_BYTES (4 << 20)
+
+struct sb_line {
+    uint32_t size;
+    uint16_t num_cells;
+    uint16_t num_spans;
+    uint8_t wrapped;
+};
+
+/* Per stored grid row. Cells from blank_from on are blanks in
+ * blank_attr whatever the grid holds there, so erasing to the end of a
+ * row only moves blank_from; term_materialize() writes them out. */
+struct row_info {
+    uint16_t blank_from;
+    uint8_t wrapped;  /* The row's line continues on the next row */
+    uint32_t blank_attr;
+};
+
+struct sb_span {
+    uint16_t count;
+    struct attr attr;
+};
+
+struct scrollback {
+    unsigned char *buf;
+    size_t size;   /* Byte budget, 0 when disabled */
+    size_t head;   /* Offset of the oldest record */
+    size_t used;
+    size_t lines;
 };
 
 struct terminal {
-    struct cell cells[MAX_TERM_ROWS][MAX_TERM_COLS];
+    /* A rows x cols grid, sized to the screen. Screen row y is stored
+     * row row_index[y]; scrolling rotates the index instead of moving
+     * cells. Use term_row(). row_info is per stored row: its blank tail
+     * and whether the line wraps, so resizing can reflow it. */
+    struct cell *cells;
+    int *row_index;
+    struct row_info *row_info;
+    int rows;
+    int cols;
+
+    /* Shift+PgUp/PgDn scroll the view view_offset lines back into
+     * history; the top rows shown then come from view_cells. Output
+     * returns the view to the bottom, as xterm does. */
+    struct scrollback history;
+    struct cell *view_cells;
+    int view_offset;
+
+    /* The alternate screen (DEC modes 47, 1047, 1049) is a second grid,
+     * allocated on first use. Switching swaps it with the one above. */
+    struct cell *alt_cells;
+    int *alt_row_index;
+    struct row_info *alt_row_info;
+    int alt_screen;  /* The alternate screen is showing */
+
+    /* DECSC/DECRC, which mode 1049 also uses */
+    int saved_cursor_x;
+    int saved_cursor_y;
+    uint32_t saved_fg_color;
+    uint32_t saved_bg_color;
+    uint32_t saved_attr_flags;
     int cursor_x;
     int cursor_y;
     int cursor_visible;
+    int cursor_style;  /* DECSCUSR: 0-1 blinking block, 2 block, 3/4 underline, 5/6 bar */
     uint32_t fg_color;
     uint32_t bg_color;
-    int bold;
+    uint32_t attr_flags;  /* SGR state; fg, bg and these are the pen */
     int scroll_top;
     int scroll_bottom;
     int master_fd;  /* PTY master fd for sending responses */
 
+    /* Damage: columns [dirty_x0, dirty_x1) of each row changed since the
+     * last render. A row is clean when dirty_x1 <= dirty_x0. */
+    int dirty_x0[MAX_TERM_ROWS];
+    int dirty_x1[MAX_TERM_ROWS];
+    int drawn_cursor_x;  /* Where the backend last drew the cursor */
+    int drawn_cursor_y;
+    int drawn_cursor_shape;
+    double cursor_blink_epoch;  /* Blinking restarts, cursor on, when it moves */
+
+    /* Cells drawn with a placeholder while their glyph was still being
+     * rasterized, repainted once the cache's ready count moves past
+     * glyphs_ready */
+    int stub_x0[MAX_TERM_ROWS];
+    int stub_x1[MAX_TERM_ROWS];
+    unsigned long glyphs_ready;
+
+    /* Pending scroll: rows move_top..move_bottom have moved up by
+     * move_lines (down if negative) since the last render. Backends that
+     * can move pixels do so and repaint only the exposed rows. */
+    int move_top;
+    int move_bottom;
+    int move_lines;
+
     /* ANSI escape sequence parser state */
     enum {
         STATE_NORMAL,
@@ -90,14 +430,70 @@ struct terminal {
     int escape_params[MAX_ESCAPE_PARAMS];
     int num_escape_params;
     int private_mode;  /* For CSI ? sequences */
+    char intermediate;  /* Intermediate byte of a CSI sequence, e.g. ' ' in CSI 2 SP q */
     char escape_buf[256];
     int escape_buf_len;
 
     /* UTF-8 decoder state */
     unsigned char utf8_buf[4];
     int utf8_buf_len;
+
+    /* Interned attributes, see term_intern_attr(). attr_hash holds an
+     * index + 1, 0 for an empty slot. Entries in [attr_dirty_lo,
+     * attr_dirty_hi) changed since the last snapshot. */
+    struct attr attrs[MAX_ATTRS];
+    uint16_t attr_hash[ATTR_HASH_SIZE];
+    uint16_t attr_free[MAX_ATTRS];
+    int num_attrs;
+    int num_attr_free;
+    int attr_dirty_lo;
+    int attr_dirty_hi;
+    uint32_t pen_attr;    /* The pen, interned */
+    uint32_t erase_attr;  /* The pen's colors without flags, for erased cells */
+    int pen_valid;        /* Cleared by SGR */
 };
 
+static inline struct cell *term_row(struct terminal *term, int y) {
+    return &term->cells[(size_t)term->row_index[y] * term->cols];
+}
+
+static inline struct row_info *term_row_info(struct terminal *term, int y) {
+    return &term->row_info[term->row_index[y]];
+}
+
+/* Row y as it is displayed, which is history while scrolled back */
+static inline struct cell *term_display_row(struct terminal *term, int y) {
+    if (y < term->view_offset) return &term->view_cells[(size_t)y * term->cols];
+    return term_row(term, y - term->view_offset);
+}
+
+/* History rows in view_cells have no blank tail */
+static const struct row_info full_row_info = { MAX_TERM_COLS, 0, 0 };
+
+static inline const struct row_info *term_display_info(struct terminal *term, int y) {
+    if (y < term->view_offset) return &full_row_info;
+    return term_row_info(term, y - term->view_offset);
+}
+
+static inline int cells_equal(struct cell a, struct cell b) {
+    return a.codepoint == b.codepoint && a.attr == b.attr;
+}
+
+/* Cell x of a row, reading its blank tail */
+static inline struct cell row_cell(const struct cell *row, const struct row_info *info, int x) {
+    if (x >= info->blank_from) return (struct cell){ ' ', info->blank_attr };
+    return row[x];
+}
+
+/* Colors a cell is drawn in, reverse video applied */
+static inline uint32_t attr_fg(const struct attr *a) {
+    return (a->flags & ATTR_INVERSE) ? a->bg_color : a->fg_color;
+}
+
+static inline uint32_t attr_bg(const struct attr *a) {
+    return (a->flags & ATTR_INVERSE) ? a->fg_color : a->bg_color;
+}
+
 /* Color palette (xterm-256 compatible) */
 uint32_t color_palette[256];
 
@@ -135,285 +531,2991 @@ void init_color_palette() {
     }
 }
 
-int fb_open(struct framebuffer *fb, const char *device, int quiet) {
-    fb->fd = open(device, O_RDWR);
-    if (fb->fd < 0) {
-        if (!quiet) perror("Failed to open framebuffer");
-        return -1;
-    }
+static double monotonic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    if (ioctl(fb->fd, FBIOGET_VSCREENINFO, &fb->vinfo) < 0) {
-        if (!quiet) perror("Failed to get variable screen info");
-        close(fb->fd);
-        return -1;
-    }
+/*
+ * Pixel formats
+ *
+ * The format is resolved once at open time into a span filler and a glyph
+ * blitter for 16, 24 or 32 bpp. XRGB8888, by far the most common layout,
+ * blends whole glyph rows with SSE2/AVX2 and stores without repacking;
+ * the other layouts look blended pixels up in a per-color-pair table.
+ */
+uint32_t fb_map_color(struct framebuffer *fb, uint32_t color) {
+    uint32_t r = (color >> 16) & 0xFF;
+    uint32_t g = (color >> 8) & 0xFF;
+    uint32_t b = color & 0xFF;
+    return ((r >> (8 - fb->red_bits)) << fb->red_shift) |
+           ((g >> (8 - fb->green_bits)) << fb->green_shift) |
+           ((b >> (8 - fb->blue_bits)) << fb->blue_shift);
+}
 
-    if (ioctl(fb->fd, FBIOGET_FSCREENINFO, &fb->finfo) < 0) {
-        if (!quiet) perror("Failed to get fixed screen info");
-        close(fb->fd);
-        return -1;
-    }
+static inline uint32_t blend_rgb(uint32_t fg_color, uint32_t bg_color, unsigned alpha) {
+    uint8_t fg_r = (fg_color >> 16) & 0xFF;
+    uint8_t fg_g = (fg_color >> 8) & 0xFF;
+    uint8_t fg_b = fg_color & 0xFF;
 
-    fb->width = fb->vinfo.xres;
-    fb->height = fb->vinfo.yres;
-    fb->bpp = fb->vinfo.bits_per_pixel;
-    fb->line_length = fb->finfo.line_length;
-    fb->mem_size = fb->finfo.smem_len;
+    uint8_t bg_r = (bg_color >> 16) & 0xFF;
+    uint8_t bg_g = (bg_color >> 8) & 0xFF;
+    uint8_t bg_b = bg_color & 0xFF;
 
-    fb->mem = mmap(NULL, fb->mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, fb->fd, 0);
-    if (fb->mem == MAP_FAILED) {
-        perror("Failed to mmap framebuffer");
-        close(fb->fd);
-        return -1;
-    }
+    uint8_t r = (fg_r * alpha + bg_r * (255 - alpha)) / 255;
+    uint8_t g = (fg_g * alpha + bg_g * (255 - alpha)) / 255;
+    uint8_t b = (fg_b * alpha + bg_b * (255 - alpha)) / 255;
 
-    return 0;
+    return (r << 16) | (g << 8) | b;
 }
 
-void fb_close(struct framebuffer *fb) {
-    if (fb->mem) {
-        munmap(fb->mem, fb->mem_size);
-    }
-    if (fb->fd >= 0) {
-        close(fb->fd);
+static void fill_span32(struct framebuffer *fb, uint8_t *dst, int width, uint32_t pixel) {
+    (void)fb;
+    uint32_t *p = (uint32_t *)dst;
+    for (int i = 0; i < width; i++) {
+        p[i] = pixel;
     }
 }
 
-void fb_put_pixel(struct framebuffer *fb, int x, int y, uint32_t color) {
-    if (x < 0 || x >= fb->width || y < 0 || y >= fb->height) {
-        return;
-    }
-    size_t offset = y * fb->line_length + x * (fb->bpp / 8);
-    if (offset + (fb->bpp / 8) > fb->mem_size) {
-        return;
+static void fill_span24(struct framebuffer *fb, uint8_t *dst, int width, uint32_t pixel) {
+    (void)fb;
+    for (int i = 0; i < width; i++) {
+        dst[0] = pixel & 0xFF;
+        dst[1] = (pixel >> 8) & 0xFF;
+        dst[2] = (pixel >> 16) & 0xFF;
+        dst += 3;
     }
-    uint32_t *pixel = (uint32_t *)(fb->mem + offset);
-    *pixel = color;
 }
 
-void fb_clear(struct framebuffer *fb, uint32_t color) {
-    for (int y = 0; y < fb->height; y++) {
-        for (int x = 0; x < fb->width; x++) {
-            fb_put_pixel(fb, x, y, color);
-        }
+static void fill_span16(struct framebuffer *fb, uint8_t *dst, int width, uint32_t pixel) {
+    (void)fb;
+    uint16_t *p = (uint16_t *)dst;
+    for (int i = 0; i < width; i++) {
+        p[i] = (uint16_t)pixel;
     }
 }
 
-void fb_draw_bitmap(struct framebuffer *fb, int x, int y,
-                    unsigned char *bitmap, int width, int height,
-                    uint32_t fg_color, uint32_t bg_color) {
+/* Fully transparent pixels are skipped: the cell background is already drawn */
+static void blit_glyph_xrgb32(struct framebuffer *fb, uint8_t *dst,
+                              const unsigned char *bitmap, int stride, int width, int height,
+                              uint32_t fg_color, uint32_t bg_color) {
     for (int j = 0; j < height; j++) {
+        uint32_t *p = (uint32_t *)(dst + j * fb->line_length);
+        const unsigned char *src = bitmap + j * stride;
         for (int i = 0; i < width; i++) {
-            unsigned char alpha = bitmap[j * width + i];
+            unsigned alpha = src[i];
+            if (alpha == 0) continue;
+            p[i] = (alpha == 255) ? fg_color : blend_rgb(fg_color, bg_color, alpha);
+        }
+    }
+}
 
-            /* Skip fully transparent pixels - background already drawn */
-            if (alpha == 0) {
-                continue;
-            }
+#if defined(__x86_64__)
+/*
+ * SIMD blend: R and B share one 32-bit lane as two 16-bit fields, G gets
+ * its own, so a single 16-bit multiply blends all channels of N pixels.
+ * x / 255 is computed exactly as (x + 1 + (x >> 8)) >> 8, which matches
+ * blend_rgb() bit for bit. Pixels with zero coverage keep their old value.
+ */
+static void blit_glyph_xrgb32_sse2(struct framebuffer *fb, uint8_t *dst,
+                                   const unsigned char *bitmap, int stride, int width, int height,
+                                   uint32_t fg_color, uint32_t bg_color) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i max_a = _mm_set1_epi32(0x00FF00FF);
+    const __m128i fg_rb = _mm_set1_epi32(fg_color & 0x00FF00FF);
+    const __m128i fg_g = _mm_set1_epi32((fg_color >> 8) & 0xFF);
+    const __m128i bg_rb = _mm_set1_epi32(bg_color & 0x00FF00FF);
+    const __m128i bg_g = _mm_set1_epi32((bg_color >> 8) & 0xFF);
 
-            if (alpha == 255) {
-                /* Fully opaque - use foreground */
-                fb_put_pixel(fb, x + i, y + j, fg_color);
+    for (int j = 0; j < height; j++) {
+        uint32_t *p = (uint32_t *)(dst + j * fb->line_length);
+        const unsigned char *src = bitmap + j * stride;
+        for (int i = 0; i < width; i += 4) {
+            /* The tail is padded with zero coverage and stored lane by lane */
+            int n = width - i < 4 ? width - i : 4;
+            uint32_t a4 = 0;
+            if (n == 4) {
+                memcpy(&a4, src + i, 4);
             } else {
-                /* Alpha blend foreground and background */
-                uint8_t fg_r = (fg_color >> 16) & 0xFF;
-                uint8_t fg_g = (fg_color >> 8) & 0xFF;
-                uint8_t fg_b = fg_color & 0xFF;
-
-                uint8_t bg_r = (bg_color >> 16) & 0xFF;
-                uint8_t bg_g = (bg_color >> 8) & 0xFF;
-                uint8_t bg_b = bg_color & 0xFF;
-
-                /* Blend using alpha */
-                uint8_t r = (fg_r * alpha + bg_r * (255 - alpha)) / 255;
-                uint8_t g = (fg_g * alpha + bg_g * (255 - alpha)) / 255;
-                uint8_t b = (fg_b * alpha + bg_b * (255 - alpha)) / 255;
-
-                uint32_t blended = (r << 16) | (g << 8) | b;
-                fb_put_pixel(fb, x + i, y + j, blended);
+                for (int k = 0; k < n; k++) a4 |= (uint32_t)src[i + k] << (8 * k);
             }
+            if (a4 == 0) continue;
+
+            __m128i a = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)a4), zero), zero);
+            __m128i a2 = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+            __m128i ia2 = _mm_sub_epi16(max_a, a2);
+
+            __m128i rb = _mm_add_epi16(_mm_mullo_epi16(fg_rb, a2), _mm_mullo_epi16(bg_rb, ia2));
+            __m128i g = _mm_add_epi16(_mm_mullo_epi16(fg_g, a2), _mm_mullo_epi16(bg_g, ia2));
+            rb = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(rb, one), _mm_srli_epi16(rb, 8)), 8);
+            g = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(g, one), _mm_srli_epi16(g, 8)), 8);
+            __m128i px = _mm_or_si128(rb, _mm_slli_epi32(g, 8));
+
+            if (n < 4) {
+                uint32_t out[4];
+                _mm_storeu_si128((__m128i *)out, px);
+                for (int k = 0; k < n; k++) {
+                    if (src[i + k]) p[i + k] = out[k];
+                }
+                continue;
+            }
+            __m128i keep = _mm_cmpeq_epi32(a, zero);
+            __m128i old = _mm_loadu_si128((const __m128i *)(p + i));
+            px = _mm_or_si128(_mm_and_si128(keep, old), _mm_andnot_si128(keep, px));
+            _mm_storeu_si128((__m128i *)(p + i), px);
         }
     }
 }
 
-int load_font(struct font_entry *font, const char *path, const char *name) {
-    FILE *file = fopen(path, "rb");
-    if (!file) {
-        return -1;
-    }
-
-    fseek(file, 0, SEEK_END);
-    font->buffer_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+__attribute__((target("avx2")))
+static void blit_glyph_xrgb32_avx2(struct framebuffer *fb, uint8_t *dst,
+                                   const unsigned char *bitmap, int stride, int width, int height,
+                                   uint32_t fg_color, uint32_t bg_color) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi16(1);
+    const __m256i max_a = _mm256_set1_epi32(0x00FF00FF);
+    const __m256i fg_rb = _mm256_set1_epi32(fg_color & 0x00FF00FF);
+    const __m256i fg_g = _mm256_set1_epi32((fg_color >> 8) & 0xFF);
+    const __m256i bg_rb = _mm256_set1_epi32(bg_color & 0x00FF00FF);
+    const __m256i bg_g = _mm256_set1_epi32((bg_color >> 8) & 0xFF);
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
 
-    font->buffer = malloc(font->buffer_size);
-    if (!font->buffer) {
-        fclose(file);
-        return -1;
+    for (int j = 0; j < height; j++) {
+        uint32_t *p = (uint32_t *)(dst + j * fb->line_length);
+        const unsigned char *src = bitmap + j * stride;
+        for (int i = 0; i < width; i += 8) {
+            /* The tail is padded with zero coverage and masked on load/store */
+            int n = width - i < 8 ? width - i : 8;
+            uint64_t a8 = 0;
+            if (n == 8) {
+                memcpy(&a8, src + i, 8);
+            } else {
+                for (int k = 0; k < n; k++) a8 |= (uint64_t)src[i + k] << (8 * k);
+            }
+            if (a8 == 0) continue;
+
+            __m256i a = _mm256_cvtepu8_epi32(_mm_cvtsi64_si128((long long)a8));
+            __m256i a2 = _mm256_or_si256(a, _mm256_slli_epi32(a, 16));
+            __m256i ia2 = _mm256_sub_epi16(max_a, a2);
+
+            __m256i rb = _mm256_add_epi16(_mm256_mullo_epi16(fg_rb, a2), _mm256_mullo_epi16(bg_rb, ia2));
+            __m256i g = _mm256_add_epi16(_mm256_mullo_epi16(fg_g, a2), _mm256_mullo_epi16(bg_g, ia2));
+            rb = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(rb, one), _mm256_srli_epi16(rb, 8)), 8);
+            g = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(g, one), _mm256_srli_epi16(g, 8)), 8);
+            __m256i px = _mm256_or_si256(rb, _mm256_slli_epi32(g, 8));
+
+            __m256i keep = _mm256_cmpeq_epi32(a, zero);
+            __m256i store = _mm256_cmpgt_epi32(_mm256_set1_epi32(n), lane);
+            __m256i old = _mm256_maskload_epi32((const int *)(p + i), store);
+            px = _mm256_blendv_epi8(px, old, keep);
+            _mm256_maskstore_epi32((int *)(p + i), store, px);
+        }
     }
+}
+#endif
 
-    fread(font->buffer, 1, font->buffer_size, file);
-    fclose(file);
-
-    int font_offset = stbtt_GetFontOffsetForIndex(font->buffer, 0);
-    if (font_offset < 0) {
-        free(font->buffer);
-        return -1;
+/*
+ * Blend tables for formats that need repacking. Terminals only use a
+ * handful of color pairs, so a small round-robin cache is enough. It is
+ * per thread so that a render worker never refills a slot another worker
+ * is still blitting from.
+ */
+static __thread struct blend_lut blend_luts[BLEND_LUT_SLOTS];
+static __thread int blend_lut_next;
+static unsigned fb_format_serial;
+
+const uint32_t *fb_blend_lut(struct framebuffer *fb, uint32_t fg_color, uint32_t bg_color) {
+    for (int i = 0; i < BLEND_LUT_SLOTS; i++) {
+        struct blend_lut *lut = &blend_luts[i];
+        if (lut->format_id == fb->format_id && lut->fg_color == fg_color &&
+            lut->bg_color == bg_color) {
+            return lut->pixel;
+        }
     }
 
-    if (!stbtt_InitFont(&font->info, font->buffer, font_offset)) {
-        free(font->buffer);
-        return -1;
+    struct blend_lut *lut = &blend_luts[blend_lut_next];
+    blend_lut_next = (blend_lut_next + 1) % BLEND_LUT_SLOTS;
+    lut->format_id = fb->format_id;
+    lut->fg_color = fg_color;
+    lut->bg_color = bg_color;
+    for (int a = 0; a < 256; a++) {
+        lut->pixel[a] = fb_map_color(fb, blend_rgb(fg_color, bg_color, a));
     }
-
-    font->name = name;
-    return 0;
+    return lut->pixel;
 }
 
-uint32_t utf8_decode(const unsigned char **p) {
-    uint32_t codepoint = 0;
-    unsigned char c = **p;
-
-    if (c == 0) {
-        return 0;
-    }
-
-    if ((c & 0x80) == 0) {
-        codepoint = c;
-        (*p)++;
-    } else if ((c & 0xE0) == 0xC0) {
-        codepoint = (c & 0x1F) << 6;
-        (*p)++;
-        if (**p && (**p & 0xC0) == 0x80) {
-            codepoint |= (**p & 0x3F);
-            (*p)++;
-        }
-    } else if ((c & 0xF0) == 0xE0) {
-        codepoint = (c & 0x0F) << 12;
-        (*p)++;
-        if (**p && (**p & 0xC0) == 0x80) {
-            codepoint |= ((**p & 0x3F) << 6);
-            (*p)++;
-            if (**p && (**p & 0xC0) == 0x80) {
-                codepoint |= (**p & 0x3F);
-                (*p)++;
-            }
-        }
-    } else if ((c & 0xF8) == 0xF0) {
-        codepoint = (c & 0x07) << 18;
-        (*p)++;
-        if (**p && (**p & 0xC0) == 0x80) {
-            codepoint |= ((**p & 0x3F) << 12);
-            (*p)++;
-            if (**p && (**p & 0xC0) == 0x80) {
-                codepoint |= ((**p & 0x3F) << 6);
-                (*p)++;
-                if (**p && (**p & 0xC0) == 0x80) {
-                    codepoint |= (**p & 0x3F);
-                    (*p)++;
-                }
-            }
+static void blit_glyph_lut32(struct framebuffer *fb, uint8_t *dst,
+                             const unsigned char *bitmap, int stride, int width, int height,
+                             uint32_t fg_color, uint32_t bg_color) {
+    const uint32_t *lut = fb_blend_lut(fb, fg_color, bg_color);
+    for (int j = 0; j < height; j++) {
+        uint32_t *p = (uint32_t *)(dst + j * fb->line_length);
+        const unsigned char *src = bitmap + j * stride;
+        for (int i = 0; i < width; i++) {
+            if (src[i]) p[i] = lut[src[i]];
         }
-    } else {
-        (*p)++;
-        return 0xFFFD;
     }
-
-    return codepoint;
 }
 
-stbtt_fontinfo* find_font_for_codepoint(struct font_entry *fonts, int num_fonts, uint32_t codepoint) {
-    for (int i = 0; i < num_fonts; i++) {
-        int glyph_index = stbtt_FindGlyphIndex(&fonts[i].info, codepoint);
-        if (glyph_index != 0) {
-            return &fonts[i].info;
+static void blit_glyph_lut24(struct framebuffer *fb, uint8_t *dst,
+                             const unsigned char *bitmap, int stride, int width, int height,
+                             uint32_t fg_color, uint32_t bg_color) {
+    const uint32_t *lut = fb_blend_lut(fb, fg_color, bg_color);
+    for (int j = 0; j < height; j++) {
+        uint8_t *p = dst + j * fb->line_length;
+        const unsigned char *src = bitmap + j * stride;
+        for (int i = 0; i < width; i++, p += 3) {
+            if (src[i] == 0) continue;
+            uint32_t pixel = lut[src[i]];
+            p[0] = pixel & 0xFF;
+            p[1] = (pixel >> 8) & 0xFF;
+            p[2] = (pixel >> 16) & 0xFF;
         }
     }
-    return &fonts[0].info;
 }
 
-void render_char(struct framebuffer *fb, struct font_entry *fonts, int num_fonts,
-                 uint32_t codepoint, int x, int y, float scale, int baseline,
-                 uint32_t fg_color, uint32_t bg_color, int char_width, int char_height) {
-
-    /* Clear cell background */
-    for (int yy = 0; yy < char_height; yy++) {
-        for (int xx = 0; xx < char_width; xx++) {
-            fb_put_pixel(fb, x + xx, y + yy, bg_color);
+static void blit_glyph_lut16(struct framebuffer *fb, uint8_t *dst,
+                             const unsigned char *bitmap, int stride, int width, int height,
+                             uint32_t fg_color, uint32_t bg_color) {
+    const uint32_t *lut = fb_blend_lut(fb, fg_color, bg_color);
+    for (int j = 0; j < height; j++) {
+        uint16_t *p = (uint16_t *)(dst + j * fb->line_length);
+        const unsigned char *src = bitmap + j * stride;
+        for (int i = 0; i < width; i++) {
+            if (src[i]) p[i] = (uint16_t)lut[src[i]];
         }
     }
+}
 
-    if (codepoint == 0 || codepoint == ' ') {
-        return;
-    }
-
-    stbtt_fontinfo *current_font = find_font_for_codepoint(fonts, num_fonts, codepoint);
-
-    int advance, lsb;
-    stbtt_GetCodepointHMetrics(current_font, codepoint, &advance, &lsb);
-
-    int c_x1, c_y1, c_x2, c_y2;
-    stbtt_GetCodepointBitmapBox(current_font, codepoint, scale, scale, &c_x1, &c_y1, &c_x2, &c_y2);
-
-    int bm_width = c_x2 - c_x1;
-    int bm_height = c_y2 - c_y1;
-
-    if (bm_width > 0 && bm_height > 0) {
-        unsigned char *bitmap = malloc(bm_width * bm_height);
-        if (bitmap) {
-            stbtt_MakeCodepointBitmap(current_font, bitmap, bm_width, bm_height,
-                                     bm_width, scale, scale, codepoint);
-
-            fb_draw_bitmap(fb, x + c_x1, y + baseline + c_y1,
-                          bitmap, bm_width, bm_height, fg_color, bg_color);
+/*
+ * Flush copies
+ *
+ * fb->mem is normally mapped write-combined. Stores to it are only fast
+ * when they fill whole 64-byte lines in order, and any read goes all the
+ * way to the device. The streaming copies align the destination to a
+ * cache line and write full lines with non-temporal stores, which drain
+ * straight through the write-combining buffers. fb_copy_rects() fences
+ * once after all of them.
+ */
+#define FB_STREAM_MIN 256  /* Below this the alignment head/tail dominate */
 
-            free(bitmap);
-        }
-    }
+static void copy_span_memcpy(uint8_t *dst, const uint8_t *src, size_t len) {
+    memcpy(dst, src, len);
 }
 
-void term_init(struct terminal *term) {
-    memset(term, 0, sizeof(*term));
-    term->fg_color = 0x00FFFFFF;
-    term->bg_color = 0x00000000;
-    term->scroll_bottom = TERM_ROWS - 1;
-    term->cursor_visible = 1;
-    term->utf8_buf_len = 0;
-    term->master_fd = -1;
-
-    for (int y = 0; y < TERM_ROWS; y++) {
-        for (int x = 0; x < TERM_COLS; x++) {
-            term->cells[y][x].codepoint = ' ';
-            term->cells[y][x].fg_color = term->fg_color;
-            term->cells[y][x].bg_color = term->bg_color;
-        }
+/* One 32-bit store per pixel; the old way, kept for --bench */
+static void copy_span_pixels(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4) {
+        uint32_t v;
+        memcpy(&v, src + i, 4);
+        *(volatile uint32_t *)(dst + i) = v;
     }
+    for (; i < len; i++) dst[i] = src[i];
 }
 
-void term_scroll_up(struct terminal *term) {
-    for (int y = term->scroll_top; y < term->scroll_bottom; y++) {
-        memcpy(term->cells[y], term->cells[y + 1], sizeof(struct cell) * TERM_COLS);
+#if defined(__x86_64__)
+static void copy_span_stream_sse2(uint8_t *dst, const uint8_t *src, size_t len) {
+    if (len < FB_STREAM_MIN) {
+        memcpy(dst, src, len);
+        return;
     }
 
-    /* Clear last line */
-    for (int x = 0; x < TERM_COLS; x++) {
-        term->cells[term->scroll_bottom][x].codepoint = ' ';
-        term->cells[term->scroll_bottom][x].fg_color = term->fg_color;
-        term->cells[term->scroll_bottom][x].bg_color = term->bg_color;
+    size_t head = (64 - ((uintptr_t)dst & 63)) & 63;
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    len -= head;
+
+    for (; len >= 64; len -= 64, dst += 64, src += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)src);
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_stream_si128((__m128i *)dst, a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
     }
+    memcpy(dst, src, len);
 }
 
-void term_scroll_down(struct terminal *term) {
-    for (int y = term->scroll_bottom; y > term->scroll_top; y--) {
-        memcpy(term->cells[y], term->cells[y - 1], sizeof(struct cell) * TERM_COLS);
+__attribute__((target("avx")))
+static void copy_span_stream_avx(uint8_t *dst, const uint8_t *src, size_t len) {
+    if (len < FB_STREAM_MIN) {
+        memcpy(dst, src, len);
+        return;
     }
 
-    /* Clear first line */
-    for (int x = 0; x < TERM_COLS; x++) {
-        term->cells[term->scroll_top][x].codepoint = ' ';
-        term->cells[term->scroll_top][x].fg_color = term->fg_color;
-        term->cells[term->scroll_top][x].bg_color = term->bg_color;
+    size_t head = (64 - ((uintptr_t)dst & 63)) & 63;
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    len -= head;
+
+    for (; len >= 64; len -= 64, dst += 64, src += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)src);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + 32));
+        _mm256_stream_si256((__m256i *)dst, a);
+        _mm256_stream_si256((__m256i *)(dst + 32), b);
     }
+    memcpy(dst, src, len);
+}
+#endif
+
+int fb_init_format(struct framebuffer *fb) {
+    fb->bytes_pp = fb->bpp / 8;
+    fb->red_shift = fb->vinfo.red.offset;
+    fb->green_shift = fb->vinfo.green.offset;
+    fb->blue_shift = fb->vinfo.blue.offset;
+    fb->red_bits = fb->vinfo.red.length;
+    fb->green_bits = fb->vinfo.green.length;
+    fb->blue_bits = fb->vinfo.blue.length;
+
+    /* Some drivers leave the bitfields empty; assume the usual layouts */
+    if (fb->red_bits == 0 || fb->green_bits == 0 || fb->blue_bits == 0) {
+        if (fb->bpp == 16) {
+            fb->red_shift = 11; fb->green_shift = 5; fb->blue_shift = 0;
+            fb->red_bits = 5;   fb->green_bits = 6;  fb->blue_bits = 5;
+        } else {
+            fb->red_shift = 16; fb->green_shift = 8; fb->blue_shift = 0;
+            fb->red_bits = 8;   fb->green_bits = 8;  fb->blue_bits = 8;
+        }
+    }
+    if (fb->red_bits > 8 || fb->green_bits > 8 || fb->blue_bits > 8) {
+        return -1;
+    }
+    fb->format_id = ++fb_format_serial;
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx")) {
+        fb->copy_span = copy_span_stream_avx;
+        fb->copy_name = "avx stream";
+    } else {
+        fb->copy_span = copy_span_stream_sse2;
+        fb->copy_name = "sse2 stream";
+    }
+#else
+    fb->copy_span = copy_span_memcpy;
+    fb->copy_name = "memcpy";
+#endif
+
+    switch (fb->bpp) {
+        case 32:
+            fb->fill_span = fill_span32;
+            if (fb->red_shift == 16 && fb->green_shift == 8 && fb->blue_shift == 0 &&
+                fb->red_bits == 8 && fb->green_bits == 8 && fb->blue_bits == 8) {
+#if defined(__x86_64__)
+                __builtin_cpu_init();
+                fb->blit_glyph = __builtin_cpu_supports("avx2") ? blit_glyph_xrgb32_avx2
+                                                                : blit_glyph_xrgb32_sse2;
+#else
+                fb->blit_glyph = blit_glyph_xrgb32;
+#endif
+            } else {
+                fb->blit_glyph = blit_glyph_lut32;
+            }
+            return 0;
+        case 24:
+            fb->fill_span = fill_span24;
+            fb->blit_glyph = blit_glyph_lut24;
+            return 0;
+        case 16:
+            fb->fill_span = fill_span16;
+            fb->blit_glyph = blit_glyph_lut16;
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/*
+ * Page flipping
+ *
+ * If the driver accepts a virtual height of two screens and can pan, we
+ * render into the hidden page and flip with FBIOPAN_DISPLAY. Otherwise we
+ * keep a single page and copy straight to the visible memory. Either way
+ * FBIO_WAITFORVSYNC, when available, paces presentation to the display.
+ */
+static void fb_init_pages(struct framebuffer *fb) {
+    fb->orig_vinfo = fb->vinfo;
+    fb->restore_vinfo = 1;
+    fb->num_pages = 1;
+    fb->page = 0;
+
+    struct fb_var_screeninfo v = fb->vinfo;
+    v.yres_virtual = v.yres * 2;
+    v.xoffset = 0;
+    v.yoffset = 0;
+    if (fb->finfo.ypanstep != 0 &&
+        ioctl(fb->fd, FBIOPUT_VSCREENINFO, &v) == 0 &&
+        ioctl(fb->fd, FBIOGET_VSCREENINFO, &v) == 0 &&
+        v.yres_virtual >= v.yres * 2 &&
+        ioctl(fb->fd, FBIOGET_FSCREENINFO, &fb->finfo) == 0 &&
+        fb->finfo.smem_len >= (size_t)fb->finfo.line_length * v.yres * 2 &&
+        ioctl(fb->fd, FBIOPAN_DISPLAY, &v) == 0) {
+        fb->vinfo = v;
+        fb->num_pages = 2;
+    } else {
+        ioctl(fb->fd, FBIOPUT_VSCREENINFO, &fb->orig_vinfo);
+        ioctl(fb->fd, FBIOGET_FSCREENINFO, &fb->finfo);
+    }
+
+    uint32_t crtc = 0;
+    fb->vsync = ioctl(fb->fd, FBIO_WAITFORVSYNC, &crtc) == 0;
+
+    /* Refresh period from the mode timings (pixclock is in picoseconds) */
+    struct fb_var_screeninfo *t = &fb->vinfo;
+    double htotal = t->xres + t->left_margin + t->right_margin + t->hsync_len;
+    double vtotal = t->yres + t->upper_margin + t->lower_margin + t->vsync_len;
+    fb->refresh_period = t->pixclock * 1e-12 * htotal * vtotal;
+    if (fb->refresh_period < 1.0 / 240 || fb->refresh_period > 1.0 / 20) {
+        fb->refresh_period = 1.0 / 60;
+    }
+}
+
+int fb_open(struct framebuffer *fb, const char *device, int quiet) {
+    fb->fd = open(device, O_RDWR);
+    if (fb->fd < 0) {
+        if (!quiet) perror("Failed to open framebuffer");
+        return -1;
+    }
+
+    if (ioctl(fb->fd, FBIOGET_VSCREENINFO, &fb->vinfo) < 0) {
+        if (!quiet) perror("Failed to get variable screen info");
+        close(fb->fd);
+        return -1;
+    }
+
+    if (ioctl(fb->fd, FBIOGET_FSCREENINFO, &fb->finfo) < 0) {
+        if (!quiet) perror("Failed to get fixed screen info");
+        close(fb->fd);
+        return -1;
+    }
+
+    fb_init_pages(fb);
+
+    fb->phys_width = fb->width = fb->vinfo.xres;
+    fb->phys_height = fb->height = fb->vinfo.yres;
+    fb->bpp = fb->vinfo.bits_per_pixel;
+    fb->line_length = fb->finfo.line_length;
+    fb->mem_size = fb->finfo.smem_len;
+
+    fb->mem = mmap(NULL, fb->mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, fb->fd, 0);
+    if (fb->mem == MAP_FAILED) {
+        perror("Failed to mmap framebuffer");
+        ioctl(fb->fd, FBIOPUT_VSCREENINFO, &fb->orig_vinfo);
+        close(fb->fd);
+        return -1;
+    }
+
+    if (fb_init_format(fb) < 0) {
+        if (!quiet) fprintf(stderr, "Unsupported framebuffer format: %d bpp\n", fb->bpp);
+        munmap(fb->mem, fb->mem_size);
+        ioctl(fb->fd, FBIOPUT_VSCREENINFO, &fb->orig_vinfo);
+        close(fb->fd);
+        return -1;
+    }
+
+    fb->back_size = (size_t)fb->line_length * fb->phys_height;
+    if (fb->back_size > fb->mem_size) fb->back_size = fb->mem_size;
+    fb->back = calloc(1, fb->back_size);
+    if (!fb->back) {
+        perror("Failed to allocate back buffer");
+        munmap(fb->mem, fb->mem_size);
+        ioctl(fb->fd, FBIOPUT_VSCREENINFO, &fb->orig_vinfo);
+        close(fb->fd);
+        return -1;
+    }
+    fb->num_damage = 0;
+
+    return 0;
+}
+
+/*
+ * DRM/KMS output
+ *
+ * The alternative to fbdev: a mode is set on the first connected
+ * connector and the two pages are XRGB8888 dumb buffers. fb_flush()
+ * fills the hidden one and queues a page flip; the flip-complete event
+ * that arrives on the DRM fd at vblank releases the old front buffer
+ * for the frame after. Drawing never sees the difference, it only
+ * touches fb->back.
+ */
+
+/* Read queued DRM events; a completed flip clears flip_pending */
+static void drm_handle_events(struct framebuffer *fb) {
+    char buf[1024];
+    ssize_t len = read(fb->fd, buf, sizeof(buf));
+
+    for (ssize_t i = 0; i + (ssize_t)sizeof(struct drm_event) <= len; ) {
+        struct drm_event ev;
+        memcpy(&ev, buf + i, sizeof(ev));
+        if (ev.type == DRM_EVENT_FLIP_COMPLETE) fb->drm.flip_pending = 0;
+        if (ev.length < sizeof(ev)) break;
+        i += ev.length;
+    }
+}
+
+/* Block until the queued flip has happened */
+static void drm_wait_flip(struct framebuffer *fb) {
+    while (fb->drm.flip_pending) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(fb->fd, &fds);
+        struct timeval tv = { 1, 0 };
+        int ret = select(fb->fd + 1, &fds, NULL, NULL, &tv);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) {
+            /* No event within a second (CRTC off, VT switched away):
+             * stop waiting rather than wedge the output */
+            fb->drm.flip_pending = 0;
+            break;
+        }
+        drm_handle_events(fb);
+    }
+}
+
+/* Pick the first connected connector, its preferred mode and a CRTC
+ * one of its encoders can drive */
+static int drm_find_output(struct framebuffer *fb) {
+    struct drm_output *d = &fb->drm;
+    struct drm_mode_card_res res = {0};
+    uint32_t *connectors = NULL, *crtcs = NULL;
+    int ret = -1;
+
+    if (ioctl(fb->fd, DRM_IOCTL_MODE_GETRESOURCES, &res) < 0 ||
+        res.count_connectors == 0 || res.count_crtcs == 0) {
+        return -1;
+    }
+    uint32_t num_connectors = res.count_connectors;
+    uint32_t num_crtcs = res.count_crtcs;
+    connectors = calloc(num_connectors, sizeof(uint32_t));
+    crtcs = calloc(num_crtcs, sizeof(uint32_t));
+    if (!connectors || !crtcs) goto out;
+
+    res.connector_id_ptr = (uintptr_t)connectors;
+    res.crtc_id_ptr = (uintptr_t)crtcs;
+    res.count_fbs = 0;
+    res.count_encoders = 0;
+    if (ioctl(fb->fd, DRM_IOCTL_MODE_GETRESOURCES, &res) < 0) goto out;
+
+    for (uint32_t i = 0; i < num_connectors && ret < 0; i++) {
+        /* First call probes and reports the counts, second fills arrays */
+        struct drm_mode_get_connector conn = { .connector_id = connectors[i] };
+        if (ioctl(fb->fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn) < 0 ||
+            conn.connection != DRM_MODE_CONNECTED || conn.count_modes == 0) {
+            continue;
+        }
+        uint32_t num_modes = conn.count_modes;
+        uint32_t num_encoders = conn.count_encoders;
+        struct drm_mode_modeinfo *modes = calloc(num_modes, sizeof(*modes));
+        uint32_t *encoders = calloc(num_encoders + 1, sizeof(uint32_t));
+        conn.modes_ptr = (uintptr_t)modes;
+        conn.encoders_ptr = (uintptr_t)encoders;
+        conn.props_ptr = 0;
+        conn.prop_values_ptr = 0;
+        conn.count_props = 0;
+
+        if (modes && encoders &&
+            ioctl(fb->fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn) == 0 &&
+            conn.count_modes > 0 && conn.count_modes <= num_modes &&
+            conn.count_encoders <= num_encoders) {
+            struct drm_mode_modeinfo *mode = &modes[0];
+            for (uint32_t m = 0; m < conn.count_modes; m++) {
+                if (modes[m].type & DRM_MODE_TYPE_PREFERRED) {
+                    mode = &modes[m];
+                    break;
+                }
+            }
+
+            /* Keep the CRTC already driving the connector, if any */
+            uint32_t crtc = 0;
+            struct drm_mode_get_encoder enc = { .encoder_id = conn.encoder_id };
+            if (conn.encoder_id && ioctl(fb->fd, DRM_IOCTL_MODE_GETENCODER, &enc) == 0) {
+                crtc = enc.crtc_id;
+            }
+            for (uint32_t e = 0; crtc == 0 && e < conn.count_encoders; e++) {
+                enc = (struct drm_mode_get_encoder){ .encoder_id = encoders[e] };
+                if (ioctl(fb->fd, DRM_IOCTL_MODE_GETENCODER, &enc) < 0) continue;
+                for (uint32_t c = 0; c < num_crtcs && c < 32; c++) {
+                    if (enc.possible_crtcs & (1u << c)) {
+                        crtc = crtcs[c];
+                        break;
+                    }
+                }
+            }
+
+            if (crtc != 0) {
+                d->crtc_id = crtc;
+                d->connector_id = conn.connector_id;
+                d->mode = *mode;
+                ret = 0;
+            }
+        }
+        free(modes);
+        free(encoders);
+    }
+
+out:
+    free(connectors);
+    free(crtcs);
+    return ret;
+}
+
+/* Scan out one of the dumb buffers, with a full modeset */
+static int drm_set_crtc(struct framebuffer *fb, uint32_t fb_id) {
+    struct drm_mode_crtc set = {
+        .set_connectors_ptr = (uintptr_t)&fb->drm.connector_id, .count_connectors = 1,
+        .crtc_id = fb->drm.crtc_id, .fb_id = fb_id, .mode_valid = 1, .mode = fb->drm.mode
+    };
+    return ioctl(fb->fd, DRM_IOCTL_MODE_SETCRTC, &set);
+}
+
+/* Undo drm_open(), also after a partial one */
+static void drm_release(struct framebuffer *fb) {
+    struct drm_output *d = &fb->drm;
+
+    drm_wait_flip(fb);
+    if (d->saved_crtc.crtc_id) {
+        /* Give the console its own framebuffer and mode back */
+        d->saved_crtc.set_connectors_ptr = (uintptr_t)&d->connector_id;
+        d->saved_crtc.count_connectors = d->saved_crtc.mode_valid ? 1 : 0;
+        ioctl(fb->fd, DRM_IOCTL_MODE_SETCRTC, &d->saved_crtc);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (d->map[i]) munmap(d->map[i], d->map_size);
+        if (d->fb_id[i]) ioctl(fb->fd, DRM_IOCTL_MODE_RMFB, &d->fb_id[i]);
+        if (d->handle[i]) {
+            struct drm_mode_destroy_dumb destroy = { d->handle[i] };
+            ioctl(fb->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+        }
+    }
+    ioctl(fb->fd, DRM_IOCTL_DROP_MASTER, 0);
+    close(fb->fd);
+    memset(d, 0, sizeof(*d));
+    fb->fd = -1;
+    fb->mem = NULL;
+    fb->is_drm = 0;
+}
+
+int drm_open(struct framebuffer *fb, const char *device, int quiet) {
+    struct drm_output *d = &fb->drm;
+
+    memset(d, 0, sizeof(*d));
+    fb->fd = open(device, O_RDWR | O_CLOEXEC);
+    if (fb->fd < 0) {
+        if (!quiet) perror("Failed to open DRM device");
+        return -1;
+    }
+    fb->is_drm = 1;
+
+    /* The first opener is master already; this covers a dropped master */
+    ioctl(fb->fd, DRM_IOCTL_SET_MASTER, 0);
+
+    if (drm_find_output(fb) < 0) {
+        if (!quiet) fprintf(stderr, "No connected display on %s\n", device);
+        drm_release(fb);
+        return -1;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        struct drm_mode_create_dumb create = {
+            .height = d->mode.vdisplay, .width = d->mode.hdisplay, .bpp = 32
+        };
+        if (ioctl(fb->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0) {
+            if (!quiet) perror("Failed to create dumb buffer");
+            drm_release(fb);
+            return -1;
+        }
+        d->handle[i] = create.handle;
+        if (create.bpp != 32 || create.pitch < create.width * 4 ||
+            create.size < (uint64_t)create.pitch * create.height) {
+            if (!quiet) fprintf(stderr, "Unsupported dumb buffer: %u bpp, pitch %u\n",
+                                create.bpp, create.pitch);
+            drm_release(fb);
+            return -1;
+        }
+        d->map_size = create.size;
+        fb->line_length = create.pitch;
+
+        struct drm_mode_fb_cmd cmd = {
+            .width = create.width, .height = create.height, .pitch = create.pitch,
+            .bpp = 32, .depth = 24, .handle = create.handle
+        };
+        struct drm_mode_map_dumb map = { .handle = create.handle };
+        if (ioctl(fb->fd, DRM_IOCTL_MODE_ADDFB, &cmd) < 0 ||
+            (d->fb_id[i] = cmd.fb_id,
+             ioctl(fb->fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0)) {
+            if (!quiet) perror("Failed to add DRM framebuffer");
+            drm_release(fb);
+            return -1;
+        }
+        uint8_t *mem = mmap(NULL, d->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fb->fd, map.offset);
+        if (mem == MAP_FAILED) {
+            if (!quiet) perror("Failed to mmap dumb buffer");
+            drm_release(fb);
+            return -1;
+        }
+        d->map[i] = mem;
+        memset(mem, 0, d->map_size);
+    }
+
+    d->saved_crtc.crtc_id = d->crtc_id;
+    if (ioctl(fb->fd, DRM_IOCTL_MODE_GETCRTC, &d->saved_crtc) < 0) {
+        memset(&d->saved_crtc, 0, sizeof(d->saved_crtc));
+    }
+    if (drm_set_crtc(fb, d->fb_id[0]) < 0) {
+        if (!quiet) perror("Failed to set DRM mode");
+        memset(&d->saved_crtc, 0, sizeof(d->saved_crtc));
+        drm_release(fb);
+        return -1;
+    }
+
+    /* The dumb buffers are XRGB8888 by construction (checked above);
+     * fb_init_format() fills in the empty bitfields */
+    memset(&fb->vinfo, 0, sizeof(fb->vinfo));
+    fb->phys_width = fb->width = d->mode.hdisplay;
+    fb->phys_height = fb->height = d->mode.vdisplay;
+    fb->bpp = 32;
+    fb->mem = d->map[0];
+    fb->mem_size = d->map_size;
+    fb->num_pages = 2;
+    fb->page = 0;
+    fb->restore_vinfo = 0;
+    fb->vsync = 1;
+    fb->refresh_period = d->mode.clock ?
+        (double)d->mode.htotal * d->mode.vtotal / (d->mode.clock * 1000.0) : 0.0;
+    if (fb->refresh_period < 1.0 / 240 || fb->refresh_period > 1.0 / 20) {
+        fb->refresh_period = 1.0 / 60;
+    }
+    fb_init_format(fb);
+
+    fb->back_size = (size_t)fb->line_length * fb->phys_height;
+    fb->back = calloc(1, fb->back_size);
+    if (!fb->back) {
+        perror("Failed to allocate back buffer");
+        drm_release(fb);
+        return -1;
+    }
+    fb->num_damage = 0;
+
+    return 0;
+}
+
+/* Open the display: an explicit device (DRM if under /dev/dri/, fbdev
+ * otherwise), else /dev/fb0. KMS is opt-in until it has run on more
+ * than one driver. */
+int output_open(struct framebuffer *fb, const char *device, int quiet) {
+    if (device && strncmp(device, "/dev/dri/", 9) == 0) return drm_open(fb, device, quiet);
+    return fb_open(fb, device ? device : "/dev/fb0", quiet);
+}
+
+void fb_close(struct framebuffer *fb) {
+    if (fb->is_drm) {
+        free(fb->back);
+        fb->back = NULL;
+        drm_release(fb);
+        return;
+    }
+
+    /* The console gets page 0 back; leave the last frame there */
+    if (fb->num_pages == 2 && fb->page != 0) {
+        memcpy(fb->mem, fb->back, fb->back_size);
+    }
+    free(fb->back);
+    fb->back = NULL;
+    if (fb->mem) {
+        munmap(fb->mem, fb->mem_size);
+    }
+    if (fb->fd >= 0) {
+        /* Hand the original virtual size and pan offset back to the console */
+        if (fb->restore_vinfo) {
+            ioctl(fb->fd, FBIOPUT_VSCREENINFO, &fb->orig_vinfo);
+        }
+        close(fb->fd);
+    }
+}
+
+/*
+ * Rotation
+ *
+ * Everything above the blit layer works in drawing coordinates
+ * (width x height). The back buffer holds pixels in panel layout, so
+ * rectangles are turned on their way in: fills become fills of the
+ * turned rectangle, glyph bitmaps are cached already turned, and damage
+ * is turned once per frame in fb_flush().
+ */
+
+/* Map a rectangle on a width x height surface onto the same surface
+ * turned by rotate quarter turns clockwise */
+static inline struct fb_rect fb_rotate_rect(int rotate, int width, int height, struct fb_rect r) {
+    switch (rotate) {
+    case 1:  return (struct fb_rect){ height - r.y - r.h, r.x, r.h, r.w };
+    case 2:  return (struct fb_rect){ width - r.x - r.w, height - r.y - r.h, r.w, r.h };
+    case 3:  return (struct fb_rect){ r.y, width - r.x - r.w, r.h, r.w };
+    default: return r;
+    }
+}
+
+/* Set the rotation; width and height become the turned drawing size */
+void fb_set_rotation(struct framebuffer *fb, int rotate) {
+    fb->rotate = rotate & 3;
+    fb->width = fb->rotate & 1 ? fb->phys_height : fb->phys_width;
+    fb->height = fb->rotate & 1 ? fb->phys_width : fb->phys_height;
+}
+
+/* fbcon's rotation, to match the console on portrait panels */
+static int fbcon_rotation(void) {
+    int rotate = 0;
+    FILE *f = fopen("/sys/class/graphics/fbcon/rotate", "r");
+    if (f) {
+        if (fscanf(f, "%d", &rotate) != 1) rotate = 0;
+        fclose(f);
+    }
+    return rotate & 3;
+}
+
+/* Clip a rectangle to the screen; returns 0 if nothing is left */
+static int fb_clip(struct framebuffer *fb, int *x, int *y, int *w, int *h) {
+    if (*x < 0) { *w += *x; *x = 0; }
+    if (*y < 0) { *h += *y; *y = 0; }
+    if (*x + *w > fb->width) *w = fb->width - *x;
+    if (*y + *h > fb->height) *h = fb->height - *y;
+    return *w > 0 && *h > 0;
+}
+
+static inline uint8_t *fb_back_ptr(struct framebuffer *fb, int x, int y) {
+    return fb->back + (size_t)y * fb->line_length + (size_t)x * fb->bytes_pp;
+}
+
+/* Record a back buffer rectangle that must reach the screen on the next flush */
+void fb_damage(struct framebuffer *fb, int x, int y, int w, int h) {
+    if (!fb_clip(fb, &x, &y, &w, &h)) return;
+
+    if (fb->num_damage == 0) {
+        fb->pending_since = monotonic_now();
+    }
+
+    /* Grow the previous rectangle when the new one extends it vertically
+     * with the same columns, or horizontally on the same rows */
+    if (fb->num_damage > 0) {
+        struct fb_rect *last = &fb->damage[fb->num_damage - 1];
+        if (last->x == x && last->w == w && last->y + last->h == y) {
+            last->h += h;
+            return;
+        }
+        if (last->y == y && last->h == h && last->x + last->w == x) {
+            last->w += w;
+            return;
+        }
+    }
+
+    if (fb->num_damage == FB_MAX_DAMAGE) {
+        /* Out of slots: collapse everything into one bounding box */
+        int x0 = x, y0 = y, x1 = x + w, y1 = y + h;
+        for (int i = 0; i < fb->num_damage; i++) {
+            struct fb_rect *r = &fb->damage[i];
+            if (r->x < x0) x0 = r->x;
+            if (r->y < y0) y0 = r->y;
+            if (r->x + r->w > x1) x1 = r->x + r->w;
+            if (r->y + r->h > y1) y1 = r->y + r->h;
+        }
+        fb->damage[0] = (struct fb_rect){ x0, y0, x1 - x0, y1 - y0 };
+        fb->num_damage = 1;
+        return;
+    }
+
+    fb->damage[fb->num_damage++] = (struct fb_rect){ x, y, w, h };
+}
+
+/* Copy rectangles from the back buffer to one screen page, one
+ * sequential row at a time */
+static void fb_copy_rects(struct framebuffer *fb, uint8_t *page,
+                          const struct fb_rect *rects, int num_rects) {
+    int bytes_pp = fb->bytes_pp;
+    size_t page_size = (size_t)fb->line_length * fb->phys_height;
+
+    for (int i = 0; i < num_rects; i++) {
+        const struct fb_rect *r = &rects[i];
+        size_t offset = (size_t)r->y * fb->line_length + (size_t)r->x * bytes_pp;
+        size_t len = (size_t)r->w * bytes_pp;
+
+        /* Full-width rectangles are one contiguous block */
+        if (r->x == 0 && r->w == fb->phys_width) {
+            size_t block = (size_t)r->h * fb->line_length;
+            if (offset + block > fb->back_size) block = fb->back_size - offset;
+            fb->copy_span(page + offset, fb->back + offset, block);
+            continue;
+        }
+
+        for (int y = 0; y < r->h; y++) {
+            if (offset + len > fb->back_size || offset + len > page_size) break;
+            fb->copy_span(page + offset, fb->back + offset, len);
+            offset += fb->line_length;
+        }
+    }
+
+#if defined(__x86_64__)
+    /* Streaming stores are weakly ordered: drain them before a pan or
+     * the next frame's vsync wait */
+    _mm_sfence();
+#endif
+}
+
+/* Present the damaged parts of the back buffer */
+void fb_flush(struct framebuffer *fb) {
+    if (fb->num_damage == 0) return;
+
+    size_t page_size = (size_t)fb->line_length * fb->phys_height;
+    uint32_t crtc = 0;
+
+    /* From here on damage is in pixels; prev_damage keeps it that way */
+    for (int i = 0; fb->rotate && i < fb->num_damage; i++) {
+        fb->damage[i] = fb_rotate_rect(fb->rotate, fb->width, fb->height, fb->damage[i]);
+    }
+
+    if (fb->is_drm) {
+        int target = fb->page ^ 1;
+
+        /* target was the front buffer until the last flip completed */
+        drm_wait_flip(fb);
+        fb_copy_rects(fb, fb->drm.map[target], fb->prev_damage, fb->num_prev_damage);
+        fb_copy_rects(fb, fb->drm.map[target], fb->damage, fb->num_damage);
+        memcpy(fb->prev_damage, fb->damage, sizeof(fb->damage[0]) * fb->num_damage);
+        fb->num_prev_damage = fb->num_damage;
+
+        struct drm_mode_crtc_page_flip flip = {
+            .crtc_id = fb->drm.crtc_id, .fb_id = fb->drm.fb_id[target],
+            .flags = DRM_MODE_PAGE_FLIP_EVENT
+        };
+        if (ioctl(fb->fd, DRM_IOCTL_MODE_PAGE_FLIP, &flip) == 0) {
+            fb->drm.flip_pending = 1;
+        } else {
+            /* No flip support (or one still queued): switch right away */
+            drm_set_crtc(fb, fb->drm.fb_id[target]);
+        }
+        /* Flip or not, target now holds the newest frame */
+        fb->page = target;
+    } else if (fb->num_pages == 2) {
+        int target = fb->page ^ 1;
+        uint8_t *page = fb->mem + target * page_size;
+
+        /* The hidden page last saw the frame before the previous one */
+        fb_copy_rects(fb, page, fb->prev_damage, fb->num_prev_damage);
+        fb_copy_rects(fb, page, fb->damage, fb->num_damage);
+        memcpy(fb->prev_damage, fb->damage, sizeof(fb->damage[0]) * fb->num_damage);
+        fb->num_prev_damage = fb->num_damage;
+
+        fb->vinfo.yoffset = target * fb->phys_height;
+        if (ioctl(fb->fd, FBIOPAN_DISPLAY, &fb->vinfo) == 0) {
+            fb->page = target;
+        } else {
+            /* Panning stopped working: fall back to the visible page */
+            struct fb_rect all = { 0, 0, fb->phys_width, fb->phys_height };
+            fb->num_pages = 1;
+            fb_copy_rects(fb, fb->mem + fb->page * page_size, &all, 1);
+        }
+        /* Don't touch the old page until the flip has happened */
+        if (fb->vsync) ioctl(fb->fd, FBIO_WAITFORVSYNC, &crtc);
+    } else {
+        if (fb->vsync) ioctl(fb->fd, FBIO_WAITFORVSYNC, &crtc);
+        fb_copy_rects(fb, fb->mem + fb->page * page_size, fb->damage, fb->num_damage);
+    }
+
+    /* Every refresh that passed while new content was waiting showed a
+     * stale frame */
+    fb->frames_presented++;
+    if (fb->vsync) {
+        fb->frames_dropped += (unsigned long)((monotonic_now() - fb->pending_since) / fb->refresh_period);
+    }
+    fb->num_damage = 0;
+}
+
+/* Give the display up for a VT switch; nothing may be drawn or
+ * flushed until fb_resume() */
+void fb_suspend(struct framebuffer *fb) {
+    if (fb->is_drm) {
+        drm_wait_flip(fb);
+        ioctl(fb->fd, DRM_IOCTL_DROP_MASTER, 0);
+    }
+}
+
+/* Take the display back after a VT switch. Whoever had it meanwhile may
+ * have changed the mode or pan offset and drawn over both pages, so the
+ * next flush repaints everything from the back buffer. */
+void fb_resume(struct framebuffer *fb) {
+    if (fb->is_drm) {
+        ioctl(fb->fd, DRM_IOCTL_SET_MASTER, 0);
+        drm_set_crtc(fb, fb->drm.fb_id[fb->page]);
+    } else if (fb->num_pages == 2) {
+        ioctl(fb->fd, FBIOPUT_VSCREENINFO, &fb->vinfo);
+    }
+    fb->prev_damage[0] = (struct fb_rect){ 0, 0, fb->phys_width, fb->phys_height };
+    fb->num_prev_damage = 1;
+    fb_damage(fb, 0, 0, fb->width, fb->height);
+}
+
+void fb_fill_rect(struct framebuffer *fb, int x, int y, int w, int h, uint32_t color) {
+    if (!fb_clip(fb, &x, &y, &w, &h)) return;
+
+    struct fb_rect r = fb_rotate_rect(fb->rotate, fb->width, fb->height, (struct fb_rect){ x, y, w, h });
+    uint32_t pixel = fb_map_color(fb, color);
+    for (int j = 0; j < r.h; j++) {
+        fb->fill_span(fb, fb_back_ptr(fb, r.x, r.y + j), r.w, pixel);
+    }
+}
+
+/* Move the pixels inside a rectangle up by dy rows (down if negative).
+ * The rows left behind keep stale pixels for the caller to repaint. */
+void fb_scroll_rect(struct framebuffer *fb, int x, int y, int w, int h, int dy) {
+    if (!fb_clip(fb, &x, &y, &w, &h)) return;
+    if (dy >= h || -dy >= h || dy == 0) return;
+
+    /* Turned, the move can go any direction: walk pixel rows so that
+     * none is read after being overwritten; memmove covers moves
+     * within a row */
+    int keep = h - (dy > 0 ? dy : -dy);
+    int src_y = dy > 0 ? y + dy : y;
+    int dst_y = dy > 0 ? y : y - dy;
+    struct fb_rect src = fb_rotate_rect(fb->rotate, fb->width, fb->height, (struct fb_rect){ x, src_y, w, keep });
+    struct fb_rect dst = fb_rotate_rect(fb->rotate, fb->width, fb->height, (struct fb_rect){ x, dst_y, w, keep });
+    size_t len = (size_t)dst.w * fb->bytes_pp;
+    if (dst.y < src.y) {
+        for (int j = 0; j < dst.h; j++) {
+            memcpy(fb_back_ptr(fb, dst.x, dst.y + j), fb_back_ptr(fb, src.x, src.y + j), len);
+        }
+    } else if (dst.y > src.y) {
+        for (int j = dst.h - 1; j >= 0; j--) {
+            memcpy(fb_back_ptr(fb, dst.x, dst.y + j), fb_back_ptr(fb, src.x, src.y + j), len);
+        }
+    } else {
+        for (int j = 0; j < dst.h; j++) {
+            memmove(fb_back_ptr(fb, dst.x, dst.y + j), fb_back_ptr(fb, src.x, src.y + j), len);
+        }
+    }
+    fb_damage(fb, x, y, w, h);
+}
+
+void fb_clear(struct framebuffer *fb, uint32_t color) {
+    /* Fill one pixel row, then replicate it */
+    fb->fill_span(fb, fb->back, fb->phys_width, fb_map_color(fb, color));
+    size_t row = (size_t)fb->phys_width * fb->bytes_pp;
+    for (int y = 1; y < fb->phys_height; y++) {
+        memcpy(fb_back_ptr(fb, 0, y), fb->back, row);
+    }
+    fb_damage(fb, 0, 0, fb->width, fb->height);
+}
+
+/* Blend the (sx, sy, w, h) part of a width x height coverage bitmap at
+ * (x, y). The bitmap is stored turned like the framebuffer, as the
+ * glyph cache keeps it. */
+void fb_draw_bitmap(struct framebuffer *fb, int x, int y,
+                    const unsigned char *bitmap, int width, int height,
+                    int sx, int sy, int w, int h,
+                    uint32_t fg_color, uint32_t bg_color) {
+    int cx = x, cy = y;
+    if (!fb_clip(fb, &cx, &cy, &w, &h)) return;
+    sx += cx - x;
+    sy += cy - y;
+
+    struct fb_rect src = fb_rotate_rect(fb->rotate, width, height, (struct fb_rect){ sx, sy, w, h });
+    struct fb_rect dst = fb_rotate_rect(fb->rotate, fb->width, fb->height, (struct fb_rect){ cx, cy, w, h });
+    int stride = fb->rotate & 1 ? height : width;
+    fb->blit_glyph(fb, fb_back_ptr(fb, dst.x, dst.y), bitmap + src.y * stride + src.x, stride,
+                   dst.w, dst.h, fg_color, bg_color);
+}
+
+static void font_coverage_set(struct font_entry *font, uint32_t codepoint) {
+    if (codepoint >= 0x110000) return;
+
+    uint64_t **page = &font->coverage[codepoint >> COVERAGE_PAGE_BITS];
+    if (!*page) {
+        *page = calloc(1 << (COVERAGE_PAGE_BITS - 3), 1);
+        if (!*page) return;
+    }
+    uint32_t bit = codepoint & ((1 << COVERAGE_PAGE_BITS) - 1);
+    (*page)[bit >> 6] |= (uint64_t)1 << (bit & 63);
+}
+
+static inline int font_covers(const struct font_entry *font, uint32_t codepoint) {
+    if (codepoint >= 0x110000) return 0;
+
+    const uint64_t *page = font->coverage[codepoint >> COVERAGE_PAGE_BITS];
+    if (!page) return 0;
+    uint32_t bit = codepoint & ((1 << COVERAGE_PAGE_BITS) - 1);
+    return (page[bit >> 6] >> (bit & 63)) & 1;
+}
+
+/*
+ * Turn the font's cmap subtable into the coverage bitset by walking its
+ * segments/groups once, instead of probing stbtt_FindGlyphIndex for every
+ * cell on every frame.
+ */
+static void font_build_coverage(struct font_entry *font) {
+    stbtt_uint8 *data = font->info.data;
+    stbtt_uint32 index_map = font->info.index_map;
+    stbtt_uint16 format = ttUSHORT(data + index_map);
+
+    if (format == 0) {
+        int bytes = ttUSHORT(data + index_map + 2);
+        for (int c = 0; c < bytes - 6 && c < 256; c++) {
+            if (data[index_map + 6 + c]) font_coverage_set(font, c);
+        }
+    } else if (format == 6) {
+        uint32_t first = ttUSHORT(data + index_map + 6);
+        uint32_t count = ttUSHORT(data + index_map + 8);
+        for (uint32_t c = first; c < first + count; c++) {
+            if (stbtt_FindGlyphIndex(&font->info, c)) font_coverage_set(font, c);
+        }
+    } else if (format == 4) {
+        int segcount = ttUSHORT(data + index_map + 6) >> 1;
+        for (int i = 0; i < segcount; i++) {
+            uint32_t last = ttUSHORT(data + index_map + 14 + 2 * i);
+            uint32_t start = ttUSHORT(data + index_map + 14 + segcount * 2 + 2 + 2 * i);
+            /* Segments with a glyph-id array can still map to glyph 0 */
+            for (uint32_t c = start; c <= last && c != 0xFFFF; c++) {
+                if (stbtt_FindGlyphIndex(&font->info, c)) font_coverage_set(font, c);
+            }
+        }
+    } else if (format == 12 || format == 13) {
+        uint32_t ngroups = ttULONG(data + index_map + 12);
+        for (uint32_t i = 0; i < ngroups; i++) {
+            uint32_t start = ttULONG(data + index_map + 16 + i * 12);
+            uint32_t end = ttULONG(data + index_map + 16 + i * 12 + 4);
+            uint32_t glyph = ttULONG(data + index_map + 16 + i * 12 + 8);
+            if (end >= 0x110000) end = 0x10FFFF;
+            for (uint32_t c = start; c <= end; c++) {
+                if (glyph != 0 || (format == 12 && c != start)) font_coverage_set(font, c);
+            }
+        }
+    }
+}
+
+void font_free(struct font_entry *font) {
+    for (int i = 0; i < COVERAGE_PAGES; i++) {
+        free(font->coverage[i]);
+        font->coverage[i] = NULL;
+    }
+    free(font->buffer);
+    font->buffer = NULL;
+}
+
+int load_font(struct font_entry *font, const char *path, const char *name) {
+    memset(font->coverage, 0, sizeof(font->coverage));
+
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return -1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    font->buffer_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    font->buffer = malloc(font->buffer_size);
+    if (!font->buffer) {
+        fclose(file);
+        return -1;
+    }
+
+    fread(font->buffer, 1, font->buffer_size, file);
+    fclose(file);
+
+    int font_offset = stbtt_GetFontOffsetForIndex(font->buffer, 0);
+    if (font_offset < 0) {
+        free(font->buffer);
+        return -1;
+    }
+
+    if (!stbtt_InitFont(&font->info, font->buffer, font_offset)) {
+        free(font->buffer);
+        return -1;
+    }
+
+    font_build_coverage(font);
+    font->name = name;
+    return 0;
+}
+
+/* Columns a codepoint takes, as wcwidth() counts them but without
+ * depending on the locale: 0, 1 or 2 */
+static inline int codepoint_width(uint32_t codepoint) {
+    if (codepoint >= 0x110000) return 1;
+    uint8_t block = wcwidth_stage1[codepoint >> WCWIDTH_BLOCK_BITS];
+    uint32_t i = codepoint & ((1 << WCWIDTH_BLOCK_BITS) - 1);
+    return (wcwidth_blocks[block][i >> 2] >> ((i & 3) * 2)) & 3;
+}
+
+uint32_t utf8_decode(const unsigned char **p) {
+    uint32_t codepoint = 0;
+    unsigned char c = **p;
+
+    if (c == 0) {
+        return 0;
+    }
+
+    if ((c & 0x80) == 0) {
+        codepoint = c;
+        (*p)++;
+    } else if ((c & 0xE0) == 0xC0) {
+        codepoint = (c & 0x1F) << 6;
+        (*p)++;
+        if (**p && (**p & 0xC0) == 0x80) {
+            codepoint |= (**p & 0x3F);
+            (*p)++;
+        }
+    } else if ((c & 0xF0) == 0xE0) {
+        codepoint = (c & 0x0F) << 12;
+        (*p)++;
+        if (**p && (**p & 0xC0) == 0x80) {
+            codepoint |= ((**p & 0x3F) << 6);
+            (*p)++;
+            if (**p && (**p & 0xC0) == 0x80) {
+                codepoint |= (**p & 0x3F);
+                (*p)++;
+            }
+        }
+    } else if ((c & 0xF8) == 0xF0) {
+        codepoint = (c & 0x07) << 18;
+        (*p)++;
+        if (**p && (**p & 0xC0) == 0x80) {
+            codepoint |= ((**p & 0x3F) << 12);
+            (*p)++;
+            if (**p && (**p & 0xC0) == 0x80) {
+                codepoint |= ((**p & 0x3F) << 6);
+                (*p)++;
+                if (**p && (**p & 0xC0) == 0x80) {
+                    codepoint |= (**p & 0x3F);
+                    (*p)++;
+                }
+            }
+        }
+    } else {
+        (*p)++;
+        return 0xFFFD;
+    }
+
+    return codepoint;
+}
+
+static int codepoint_to_utf8(uint32_t cp, char *buf) {
+    if (cp < 0x80) {
+        buf[0] = (char)cp;
+        return 1;
+    } else if (cp < 0x800) {
+        buf[0] = (char)(0xC0 | (cp >> 6));
+        buf[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    } else if (cp < 0x10000) {
+        buf[0] = (char)(0xE0 | (cp >> 12));
+        buf[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        buf[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    } else {
+        buf[0] = (char)(0xF0 | (cp >> 18));
+        buf[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        buf[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        buf[3] = (char)(0x80 | (cp & 0x3F));
+        return 4;
+    }
+}
+
+int find_font_for_codepoint(struct font_entry *fonts, int num_fonts, uint32_t codepoint,
+                            int *glyph_index) {
+    for (int i = 0; i < num_fonts; i++) {
+        if (font_covers(&fonts[i], codepoint)) {
+            *glyph_index = stbtt_FindGlyphIndex(&fonts[i].info, codepoint);
+            return i;
+        }
+    }
+    *glyph_index = 0;
+    return 0;
+}
+
+/*
+ * Glyph cache
+ *
+ * Coverage bitmaps are rasterized once and reused every frame. Codepoints
+ * below GLYPH_HOT_SIZE (ASCII + Latin) live in a direct-indexed table that
+ * is never evicted; everything else (CJK, other scripts) goes through a
+ * hash table keyed by (font, glyph index, size, style) with an LRU list
+ * bounded by GLYPH_CACHE_BUDGET bytes.
+ */
+#define GLYPH_HOT_SIZE      0x250
+#define GLYPH_HASH_SIZE     4096
+#define GLYPH_CACHE_BUDGET  (4 * 1024 * 1024)
+#define GLYPH_STYLE_REGULAR 0
+#define GLYPH_STYLE_BOLD    1
+#define GLYPH_NUM_STYLES    2
+#define FONT_RESOLVE_SIZE   4096
+#define RASTER_MAX_THREADS  4
+#define MAX_PREWARM_RANGES  16
+
+struct glyph {
+    /* Key */
+    int font;
+    int glyph_index;
+    float scale;
+    int style;
+
+    /* Coverage bitmap, positioned relative to the cell's top-left corner.
+     * width and height are unturned; the pixels are stored turned by the
+     * cache's rotate. */
+    int x0, y0;
+    int width, height;
+    unsigned char *bitmap;
+
+    /* Set while queued for the raster threads; the fields above are only
+     * valid once it reads 0 (acquire) */
+    int pending;
+    struct glyph *job_next;
+
+    struct glyph *hash_next;
+    struct glyph *lru_prev, *lru_next;
+};
+
+struct prewarm_range {
+    uint32_t first, last;
+};
+
+/* Fallback result for one codepoint */
+struct font_resolution {
+    uint32_t codepoint;
+    int font;
+    int glyph_index;
+};
+
+struct glyph_cache {
+    struct font_entry *fonts;
+    int num_fonts;
+    float scale;
+    int baseline;
+    int rotate;  /* Bitmaps are stored turned like the framebuffer */
+
+    /* Render workers share the cache. Hot entries never change once set
+     * and are read without the lock, and hits is bumped atomically;
+     * everything else is under the lock. Glyphs are only freed by
+     * glyph_cache_trim(), between frames, so a pointer returned by lookup
+     * stays valid until the frame is done. */
+    pthread_mutex_t lock;
+
+    /* Direct-mapped codepoint -> (font, glyph index) cache */
+    struct font_resolution resolved[FONT_RESOLVE_SIZE];
+
+    struct glyph *hot[GLYPH_NUM_STYLES][GLYPH_HOT_SIZE];
+    struct glyph *buckets[GLYPH_HASH_SIZE];
+    struct glyph lru;  /* Sentinel: lru.lru_next is most recently used */
+    size_t bytes;      /* Bitmap + entry bytes held by the LRU part */
+
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+
+    /* Background rasterizer, see glyph_raster_start(). Misses outside the
+     * hot range are queued as pending entries, which are kept out of the
+     * LRU until filled in. Under the lock, except ready (atomic). */
+    pthread_t raster_threads[RASTER_MAX_THREADS];
+    int num_raster_threads;
+    pthread_cond_t raster_cond;
+    int raster_stop;
+    struct glyph *jobs_head, *jobs_tail;
+    unsigned long ready;              /* Bumped for every glyph filled in */
+    void (*notify)(void *arg);        /* Called by raster threads after that */
+    void *notify_arg;
+
+    /* Ranges rasterized while the queue is empty */
+    struct prewarm_range prewarm[MAX_PREWARM_RANGES];
+    int num_prewarm;
+    int prewarm_range;
+    uint32_t prewarm_next;
+};
+
+void glyph_cache_init(struct glyph_cache *cache, struct font_entry *fonts, int num_fonts,
+                      float scale, int baseline) {
+    memset(cache, 0, sizeof(*cache));
+    cache->fonts = fonts;
+    cache->num_fonts = num_fonts;
+    cache->scale = scale;
+    cache->baseline = baseline;
+    cache->lru.lru_prev = &cache->lru;
+    cache->lru.lru_next = &cache->lru;
+    for (int i = 0; i < FONT_RESOLVE_SIZE; i++) {
+        cache->resolved[i].codepoint = UINT32_MAX;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+static void glyph_free(struct glyph *g) {
+    free(g->bitmap);
+    free(g);
+}
+
+void glyph_cache_free(struct glyph_cache *cache) {
+    for (int s = 0; s < GLYPH_NUM_STYLES; s++) {
+        for (int i = 0; i < GLYPH_HOT_SIZE; i++) {
+            if (cache->hot[s][i]) glyph_free(cache->hot[s][i]);
+        }
+    }
+    struct glyph *g = cache->lru.lru_next;
+    while (g != &cache->lru) {
+        struct glyph *next = g->lru_next;
+        glyph_free(g);
+        g = next;
+    }
+    pthread_mutex_destroy(&cache->lock);
+    glyph_cache_init(cache, cache->fonts, cache->num_fonts, cache->scale, cache->baseline);
+}
+
+static unsigned glyph_hash(int font, int glyph_index, int style) {
+    uint32_t h = (uint32_t)glyph_index * 2654435761u;
+    h ^= (uint32_t)(font * GLYPH_NUM_STYLES + style) * 40503u;
+    return (h >> 16) & (GLYPH_HASH_SIZE - 1);
+}
+
+static size_t glyph_bytes(struct glyph *g) {
+    return sizeof(*g) + (size_t)g->width * g->height;
+}
+
+static void glyph_lru_unlink(struct glyph *g) {
+    g->lru_prev->lru_next = g->lru_next;
+    g->lru_next->lru_prev = g->lru_prev;
+}
+
+static void glyph_lru_push_front(struct glyph_cache *cache, struct glyph *g) {
+    g->lru_prev = &cache->lru;
+    g->lru_next = cache->lru.lru_next;
+    cache->lru.lru_next->lru_prev = g;
+    cache->lru.lru_next = g;
+}
+
+static void glyph_cache_evict(struct glyph_cache *cache) {
+    struct glyph *victim = cache->lru.lru_prev;
+    if (victim == &cache->lru) return;
+
+    struct glyph **pp = &cache->buckets[glyph_hash(victim->font, victim->glyph_index, victim->style)];
+    while (*pp && *pp != victim) pp = &(*pp)->hash_next;
+    if (*pp) *pp = victim->hash_next;
+
+    glyph_lru_unlink(victim);
+    cache->bytes -= glyph_bytes(victim);
+    cache->evictions++;
+    glyph_free(victim);
+}
+
+/* Synthetic bold: smear coverage one pixel to the right */
+static void glyph_embolden(struct glyph *g) {
+    for (int j = 0; j < g->height; j++) {
+        unsigned char *row = g->bitmap + j * g->width;
+        for (int i = g->width - 1; i > 0; i--) {
+            if (row[i - 1] > row[i]) row[i] = row[i - 1];
+        }
+    }
+}
+
+/* Turn the bitmap into framebuffer layout once, so blits stay row copies */
+static int glyph_rotate(struct glyph *g, int rotate) {
+    if (rotate == 0 || !g->bitmap) return 0;
+
+    unsigned char *turned = malloc((size_t)g->width * g->height);
+    if (!turned) return -1;
+    int stride = rotate & 1 ? g->height : g->width;
+    for (int j = 0; j < g->height; j++) {
+        for (int i = 0; i < g->width; i++) {
+            struct fb_rect p = fb_rotate_rect(rotate, g->width, g->height, (struct fb_rect){ i, j, 1, 1 });
+            turned[p.y * stride + p.x] = g->bitmap[j * g->width + i];
+        }
+    }
+    free(g->bitmap);
+    g->bitmap = turned;
+    return 0;
+}
+
+static struct glyph *glyph_rasterize(struct glyph_cache *cache, int font, int glyph_index, int style) {
+    struct glyph *g = calloc(1, sizeof(*g));
+    if (!g) return NULL;
+
+    g->font = font;
+    g->glyph_index = glyph_index;
+    g->scale = cache->scale;
+    g->style = style;
+
+    stbtt_fontinfo *info = &cache->fonts[font].info;
+    int c_x1, c_y1, c_x2, c_y2;
+    stbtt_GetGlyphBitmapBox(info, glyph_index, cache->scale, cache->scale, &c_x1, &c_y1, &c_x2, &c_y2);
+
+    int bm_width = c_x2 - c_x1;
+    int bm_height = c_y2 - c_y1;
+    if (bm_width <= 0 || bm_height <= 0) {
+        /* Blank glyph: cache the empty result so we don't ask again */
+        return g;
+    }
+
+    /* Leave one spare column for synthetic bold */
+    int stride = bm_width + (style == GLYPH_STYLE_BOLD ? 1 : 0);
+    g->bitmap = calloc((size_t)stride * bm_height, 1);
+    if (!g->bitmap) {
+        free(g);
+        return NULL;
+    }
+    stbtt_MakeGlyphBitmap(info, g->bitmap, bm_width, bm_height, stride,
+                          cache->scale, cache->scale, glyph_index);
+
+    g->x0 = c_x1;
+    g->y0 = cache->baseline + c_y1;
+    g->width = stride;
+    g->height = bm_height;
+
+    if (style == GLYPH_STYLE_BOLD) glyph_embolden(g);
+    if (glyph_rotate(g, cache->rotate) < 0) {
+        glyph_free(g);
+        return NULL;
+    }
+    return g;
+}
+
+/* Font fallback in one table probe; the coverage bitsets handle misses */
+static int glyph_cache_resolve(struct glyph_cache *cache, uint32_t codepoint, int *glyph_index) {
+    struct font_resolution *r = &cache->resolved[(codepoint * 2654435761u) >> 20];
+    if (r->codepoint != codepoint) {
+        r->codepoint = codepoint;
+        r->font = find_font_for_codepoint(cache->fonts, cache->num_fonts, codepoint, &r->glyph_index);
+    }
+    *glyph_index = r->glyph_index;
+    return r->font;
+}
+
+struct glyph *glyph_cache_lookup(struct glyph_cache *cache, uint32_t codepoint, int style) {
+    if (codepoint < GLYPH_HOT_SIZE) {
+        struct glyph *g = __atomic_load_n(&cache->hot[style][codepoint], __ATOMIC_ACQUIRE);
+        if (g) {
+            __atomic_fetch_add(&cache->hits, 1, __ATOMIC_RELAXED);
+            return g;
+        }
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    int glyph_index;
+    int font = glyph_cache_resolve(cache, codepoint, &glyph_index);
+
+    unsigned h = glyph_hash(font, glyph_index, style);
+    if (codepoint >= GLYPH_HOT_SIZE) {
+        for (struct glyph *g = cache->buckets[h]; g; g = g->hash_next) {
+            if (g->glyph_index == glyph_index && g->font == font &&
+                g->style == style && g->scale == cache->scale) {
+                /* A placeholder being drawn again is not a hit */
+                if (!__atomic_load_n(&g->pending, __ATOMIC_ACQUIRE)) {
+                    __atomic_fetch_add(&cache->hits, 1, __ATOMIC_RELAXED);
+                    glyph_lru_unlink(g);
+                    glyph_lru_push_front(cache, g);
+                }
+                pthread_mutex_unlock(&cache->lock);
+                return g;
+            }
+        }
+    }
+    cache->misses++;
+
+    /* With raster threads running, big-script misses don't hold up the
+     * frame: queue a pending entry and let the caller draw a placeholder */
+    if (cache->num_raster_threads > 0 && codepoint >= GLYPH_HOT_SIZE) {
+        struct glyph *g = calloc(1, sizeof(*g));
+        if (g) {
+            g->font = font;
+            g->glyph_index = glyph_index;
+            g->scale = cache->scale;
+            g->style = style;
+            g->pending = 1;
+            g->hash_next = cache->buckets[h];
+            cache->buckets[h] = g;
+            if (cache->jobs_tail) cache->jobs_tail->job_next = g;
+            else cache->jobs_head = g;
+            cache->jobs_tail = g;
+            pthread_cond_signal(&cache->raster_cond);
+        }
+        pthread_mutex_unlock(&cache->lock);
+        return g;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    /* Rasterize without the lock so workers missing on different glyphs
+     * don't serialize; if two race on the same one, the loser's copy is
+     * dropped below */
+    struct glyph *g = glyph_rasterize(cache, font, glyph_index, style);
+    if (!g) return NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    if (codepoint < GLYPH_HOT_SIZE) {
+        struct glyph *cur = cache->hot[style][codepoint];
+        if (cur) {
+            glyph_free(g);
+            g = cur;
+        } else {
+            __atomic_store_n(&cache->hot[style][codepoint], g, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&cache->lock);
+        return g;
+    }
+
+    for (struct glyph *cur = cache->buckets[h]; cur; cur = cur->hash_next) {
+        if (cur->glyph_index == glyph_index && cur->font == font &&
+            cur->style == style && cur->scale == cache->scale) {
+            glyph_free(g);
+            pthread_mutex_unlock(&cache->lock);
+            return cur;
+        }
+    }
+
+    cache->bytes += glyph_bytes(g);
+    g->hash_next = cache->buckets[h];
+    cache->buckets[h] = g;
+    glyph_lru_push_front(cache, g);
+    pthread_mutex_unlock(&cache->lock);
+    return g;
+}
+
+/* Evict down to the budget; call once no glyph from this frame is in use */
+void glyph_cache_trim(struct glyph_cache *cache) {
+    pthread_mutex_lock(&cache->lock);
+    while (cache->bytes > GLYPH_CACHE_BUDGET && cache->lru.lru_prev != &cache->lru) {
+        glyph_cache_evict(cache);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Background rasterizer
+ *
+ * A screen full of new CJK would otherwise rasterize every glyph inside
+ * the frame. The raster threads fill in queued entries and bump ready;
+ * term_render() repaints the cells that got a placeholder once it sees
+ * that change. With the queue empty they work through the pre-warm
+ * ranges while the cache is below three quarters of its budget.
+ */
+static int glyph_raster_prewarm(struct glyph_cache *cache) {
+    while (cache->prewarm_range < cache->num_prewarm &&
+           cache->bytes < GLYPH_CACHE_BUDGET / 4 * 3) {
+        struct prewarm_range *r = &cache->prewarm[cache->prewarm_range];
+        if (cache->prewarm_next < r->first) cache->prewarm_next = r->first;
+        if (cache->prewarm_next > r->last) {
+            cache->prewarm_range++;
+            continue;
+        }
+        uint32_t codepoint = cache->prewarm_next++;
+        if (codepoint < GLYPH_HOT_SIZE) continue;
+
+        int glyph_index;
+        int font = glyph_cache_resolve(cache, codepoint, &glyph_index);
+        if (glyph_index == 0) continue;
+        unsigned h = glyph_hash(font, glyph_index, GLYPH_STYLE_REGULAR);
+        struct glyph *cur = cache->buckets[h];
+        while (cur && !(cur->glyph_index == glyph_index && cur->font == font &&
+                        cur->style == GLYPH_STYLE_REGULAR && cur->scale == cache->scale)) {
+            cur = cur->hash_next;
+        }
+        if (cur) continue;
+
+        pthread_mutex_unlock(&cache->lock);
+        struct glyph *g = glyph_rasterize(cache, font, glyph_index, GLYPH_STYLE_REGULAR);
+        pthread_mutex_lock(&cache->lock);
+        if (!g) return 0;
+
+        /* A lookup may have queued the same glyph meanwhile */
+        for (cur = cache->buckets[h]; cur; cur = cur->hash_next) {
+            if (cur->glyph_index == glyph_index && cur->font == font &&
+                cur->style == GLYPH_STYLE_REGULAR && cur->scale == cache->scale) {
+                break;
+            }
+        }
+        if (cur) {
+            glyph_free(g);
+        } else {
+            cache->bytes += glyph_bytes(g);
+            g->hash_next = cache->buckets[h];
+            cache->buckets[h] = g;
+            glyph_lru_push_front(cache, g);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static void *glyph_raster_worker(void *arg) {
+    struct glyph_cache *cache = arg;
+
+    pthread_mutex_lock(&cache->lock);
+    while (!cache->raster_stop) {
+        struct glyph *job = cache->jobs_head;
+        if (!job) {
+            if (!glyph_raster_prewarm(cache)) {
+                pthread_cond_wait(&cache->raster_cond, &cache->lock);
+            }
+            continue;
+        }
+        cache->jobs_head = job->job_next;
+        if (!cache->jobs_head) cache->jobs_tail = NULL;
+        pthread_mutex_unlock(&cache->lock);
+
+        struct glyph *g = glyph_rasterize(cache, job->font, job->glyph_index, job->style);
+
+        pthread_mutex_lock(&cache->lock);
+        if (g) {
+            job->x0 = g->x0;
+            job->y0 = g->y0;
+            job->width = g->width;
+            job->height = g->height;
+            job->bitmap = g->bitmap;
+            free(g);
+        }
+        /* Out of memory leaves it blank rather than pending forever */
+        cache->bytes += glyph_bytes(job);
+        glyph_lru_push_front(cache, job);
+        __atomic_store_n(&job->pending, 0, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&cache->ready, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&cache->lock);
+
+        if (cache->notify) cache->notify(cache->notify_arg);
+
+        pthread_mutex_lock(&cache->lock);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+/* Parse "4E00-9FFF,3040-30FF" (hex, single codepoints allowed) into the
+ * pre-warm list; returns -1 on a malformed list */
+int glyph_cache_set_prewarm(struct glyph_cache *cache, const char *ranges) {
+    int num = 0;
+    while (*ranges) {
+        char *end;
+        unsigned long first = strtoul(ranges, &end, 16);
+        unsigned long last = first;
+        if (end == ranges) return -1;
+        if (*end == '-') {
+            ranges = end + 1;
+            last = strtoul(ranges, &end, 16);
+            if (end == ranges) return -1;
+        }
+        if (first > last || last >= 0x110000 || num == MAX_PREWARM_RANGES) return -1;
+        cache->prewarm[num++] = (struct prewarm_range){ first, last };
+        if (*end == ',') end++;
+        else if (*end) return -1;
+        ranges = end;
+    }
+    cache->num_prewarm = num;
+    return 0;
+}
+
+/* Move misses outside the hot range to background threads.
+ * notify(arg) is called from them whenever a glyph has been filled in. */
+void glyph_raster_start(struct glyph_cache *cache, int threads,
+                        void (*notify)(void *arg), void *arg) {
+    if (threads > RASTER_MAX_THREADS) threads = RASTER_MAX_THREADS;
+    pthread_cond_init(&cache->raster_cond, NULL);
+    cache->notify = notify;
+    cache->notify_arg = arg;
+
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&cache->raster_threads[i], NULL, glyph_raster_worker, cache) != 0) break;
+        cache->num_raster_threads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void glyph_raster_stop(struct glyph_cache *cache) {
+    if (cache->num_raster_threads == 0) return;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->raster_stop = 1;
+    pthread_cond_broadcast(&cache->raster_cond);
+    pthread_mutex_unlock(&cache->lock);
+    for (int i = 0; i < cache->num_raster_threads; i++) {
+        pthread_join(cache->raster_threads[i], NULL);
+    }
+
+    /* Renderers may still be running: from here on misses rasterize
+     * inline, and leftover jobs become blank entries that
+     * glyph_cache_free() finds */
+    pthread_mutex_lock(&cache->lock);
+    cache->num_raster_threads = 0;
+    while (cache->jobs_head) {
+        struct glyph *job = cache->jobs_head;
+        cache->jobs_head = job->job_next;
+        glyph_lru_push_front(cache, job);
+        __atomic_store_n(&job->pending, 0, __ATOMIC_RELEASE);
+    }
+    cache->jobs_tail = NULL;
+    pthread_mutex_unlock(&cache->lock);
+    pthread_cond_destroy(&cache->raster_cond);
+}
+
+/*
+ * Procedural glyphs
+ *
+ * Box drawing (U+2500-257F), block elements (U+2580-259F) and braille
+ * (U+2800-28FF) are drawn straight from the cell size with span fills
+ * instead of going through font fallback and the rasterizer. Lines sit
+ * at the same offsets in every cell, so they join across cells without
+ * gaps or antialiased seams.
+ */
+#define BOX_NONE   0
+#define BOX_LIGHT  1
+#define BOX_HEAVY  2
+#define BOX_DOUBLE 3
+
+/* Arm weights of U+2500..U+257F as left, right, up, down. Dashed lines
+ * use their solid weights and are cut up by render_box_dashes(); the
+ * rounded corners are drawn square; the diagonals have no arms. */
+static const char box_arms[128][5] = {
+    /* 2500 */ "1100", "2200", "0011", "0022", "1100", "2200", "0011", "0022",
+    /* 2508 */ "1100", "2200", "0011", "0022", "0101", "0201", "0102", "0202",
+    /* 2510 */ "1001", "2001", "1002", "2002", "0110", "0210", "0120", "0220",
+    /* 2518 */ "1010", "2010", "1020", "2020", "0111", "0211", "0121", "0112",
+    /* 2520 */ "0122", "0221", "0212", "0222", "1011", "2011", "1021", "1012",
+    /* 2528 */ "1022", "2021", "2012", "2022", "1101", "2101", "1201", "2201",
+    /* 2530 */ "1102", "2102", "1202", "2202", "1110", "2110", "1210", "2210",
+    /* 2538 */ "1120", "2120", "1220", "2220", "1111", "2111", "1211", "2211",
+    /* 2540 */ "1121", "1112", "1122", "2121", "1221", "2112", "1212", "2221",
+    /* 2548 */ "2212", "2122", "1222", "2222", "1100", "2200", "0011", "0022",
+    /* 2550 */ "3300", "0033", "0301", "0103", "0303", "3001", "1003", "3003",
+    /* 2558 */ "0310", "0130", "0330", "3010", "1030", "3030", "0311", "0133",
+    /* 2560 */ "0333", "3011", "1033", "3033", "3301", "1103", "3303", "3310",
+    /* 2568 */ "1130", "3330", "3311", "1133", "3333", "0101", "1001", "1010",
+    /* 2570 */ "0110", "0000", "0000", "0000", "1000", "0010", "0100", "0001",
+    /* 2578 */ "2000", "0020", "0200", "0002", "1200", "0012", "2100", "0021",
+};
+
+/* Fill, in cell coordinates, a rectangle given along and across an arm's
+ * axis; vertical arms are drawn as transposed horizontal ones */
+static void box_fill(struct framebuffer *fb, int x, int y, int vertical,
+                     int a0, int a1, int b0, int b1, uint32_t color) {
+    if (a1 <= a0 || b1 <= b0) return;
+    if (vertical) {
+        fb_fill_rect(fb, x + b0, y + a0, b1 - b0, a1 - a0, color);
+    } else {
+        fb_fill_rect(fb, x + a0, y + b0, a1 - a0, b1 - b0, color);
+    }
+}
+
+/* Where a line of this weight lies across an axis of length n */
+static void box_extent(int weight, int n, int t, int *lo, int *hi) {
+    int w = weight == BOX_HEAVY ? 2 * t : weight == BOX_DOUBLE ? 3 * t : t;
+    *lo = (n - w) / 2;
+    *hi = *lo + w;
+}
+
+/*
+ * One arm running from the middle of the cell to its low (left/up) or
+ * high (right/down) edge. pb and pa are the perpendicular arms on the
+ * arm's low and high side (up/down for horizontal arms, left/right for
+ * vertical ones) and opp the arm opposite this one; together they decide
+ * where each line stops so that corners, tees and doubled lines meet.
+ */
+static void box_arm(struct framebuffer *fb, int x, int y, int vertical, int high,
+                    int weight, int pb, int pa, int opp,
+                    int n_along, int n_across, int t, uint32_t color) {
+    /* Extent of the perpendicular structure along this arm */
+    int b_lo = 0, b_hi = 0, a_lo = 0, a_hi = 0;
+    int p0 = n_along / 2, p1 = n_along / 2;
+    if (pb) box_extent(pb, n_along, t, &b_lo, &b_hi);
+    if (pa) box_extent(pa, n_along, t, &a_lo, &a_hi);
+    if (pb && pa) {
+        p0 = b_lo < a_lo ? b_lo : a_lo;
+        p1 = b_hi > a_hi ? b_hi : a_hi;
+    } else if (pb) {
+        p0 = b_lo; p1 = b_hi;
+    } else if (pa) {
+        p0 = a_lo; p1 = a_hi;
+    }
+
+    if (weight != BOX_DOUBLE) {
+        int lo, hi;
+        box_extent(weight, n_across, t, &lo, &hi);
+        int perp_double = pb == BOX_DOUBLE || pa == BOX_DOUBLE;
+        if (high) {
+            /* Stop at the near line of a double, or cross it if the
+             * opposite arm continues */
+            int start = perp_double && !opp ? p1 - t : p0;
+            box_fill(fb, x, y, vertical, start, n_along, lo, hi, color);
+        } else {
+            int end = perp_double && !opp ? p0 + t : p1;
+            box_fill(fb, x, y, vertical, 0, end, lo, hi, color);
+        }
+        return;
+    }
+
+    /* Double: each of the two lines turns into the perpendicular arm on
+     * its side, or runs to the far edge of the structure if there is none */
+    int d0 = (n_across - 3 * t) / 2;
+    for (int side = 0; side < 2; side++) {
+        int perp = side ? pa : pb;
+        int lo = side ? a_lo : b_lo, hi = side ? a_hi : b_hi;
+        int across = d0 + side * 2 * t;
+        if (high) {
+            int start = perp ? (perp == BOX_DOUBLE ? hi - t : hi) : p0;
+            box_fill(fb, x, y, vertical, start, n_along, across, across + t, color);
+        } else {
+            int end = perp ? (perp == BOX_DOUBLE ? lo + t : lo) : p1;
+            box_fill(fb, x, y, vertical, 0, end, across, across + t, color);
+        }
+    }
+}
+
+/* Dashed lines: n dashes per cell with gaps between them */
+static void render_box_dashes(struct framebuffer *fb, int x, int y, int vertical, int weight,
+                              int dashes, int n_along, int n_across, int t, uint32_t color) {
+    int lo, hi;
+    box_extent(weight, n_across, t, &lo, &hi);
+    int gap = n_along / (dashes * 3) > 1 ? n_along / (dashes * 3) : 1;
+    for (int i = 0; i < dashes; i++) {
+        int a0 = i * n_along / dashes;
+        int a1 = (i + 1) * n_along / dashes - gap;
+        box_fill(fb, x, y, vertical, a0, a1, lo, hi, color);
+    }
+}
+
+static void render_box(struct framebuffer *fb, uint32_t codepoint, int x, int y,
+                       uint32_t color, int char_width, int char_height) {
+    int t = char_width / 8 > 1 ? char_width / 8 : 1;
+    while (t > 1 && (3 * t > char_width || 3 * t > char_height)) t--;
+
+    if (codepoint >= 0x2571 && codepoint <= 0x2573) {
+        /* Diagonals: one short span per pixel row */
+        int w = t + char_width / char_height;
+        for (int j = 0; j < char_height; j++) {
+            int dx = j * (char_width - w) / (char_height > 1 ? char_height - 1 : 1);
+            if (codepoint != 0x2572)
+                fb_fill_rect(fb, x + char_width - w - dx, y + j, w, 1, color);
+            if (codepoint != 0x2571)
+                fb_fill_rect(fb, x + dx, y + j, w, 1, color);
+        }
+        return;
+    }
+
+    const char *arms = box_arms[codepoint - 0x2500];
+    int l = arms[0] - '0', r = arms[1] - '0', u = arms[2] - '0', d = arms[3] - '0';
+
+    int dashes = 0;
+    if (codepoint >= 0x2504 && codepoint <= 0x250B) dashes = codepoint < 0x2508 ? 3 : 4;
+    if (codepoint >= 0x254C && codepoint <= 0x254F) dashes = 2;
+    if (dashes) {
+        if (l) render_box_dashes(fb, x, y, 0, l, dashes, char_width, char_height, t, color);
+        else render_box_dashes(fb, x, y, 1, u, dashes, char_height, char_width, t, color);
+        return;
+    }
+
+    if (l) box_arm(fb, x, y, 0, 0, l, u, d, r, char_width, char_height, t, color);
+    if (r) box_arm(fb, x, y, 0, 1, r, u, d, l, char_width, char_height, t, color);
+    if (u) box_arm(fb, x, y, 1, 0, u, l, r, d, char_height, char_width, t, color);
+    if (d) box_arm(fb, x, y, 1, 1, d, l, r, u, char_height, char_width, t, color);
+}
+
+/* Quadrant masks of U+2596..U+259F: upper left 1, upper right 2,
+ * lower left 4, lower right 8 */
+static const unsigned char block_quadrants[10] = { 4, 8, 1, 13, 9, 7, 11, 2, 6, 14 };
+
+static void render_block(struct framebuffer *fb, uint32_t codepoint, int x, int y,
+                         uint32_t fg_color, uint32_t bg_color, int char_width, int char_height) {
+    int cw = char_width, ch = char_height;
+
+    if (codepoint == 0x2580) {                      /* Upper half */
+        fb_fill_rect(fb, x, y, cw, ch / 2, fg_color);
+    } else if (codepoint <= 0x2588) {               /* Lower 1/8 .. full */
+        int k = codepoint - 0x2580;
+        int top = ch * (8 - k) / 8;
+        fb_fill_rect(fb, x, y + top, cw, ch - top, fg_color);
+    } else if (codepoint <= 0x258F) {               /* Left 7/8 .. 1/8 */
+        int k = 0x2590 - codepoint;
+        fb_fill_rect(fb, x, y, cw * k / 8, ch, fg_color);
+    } else if (codepoint == 0x2590) {               /* Right half */
+        fb_fill_rect(fb, x + cw / 2, y, cw - cw / 2, ch, fg_color);
+    } else if (codepoint <= 0x2593) {               /* Shades: solid blends */
+        unsigned alpha = (codepoint - 0x2590) * 64;
+        fb_fill_rect(fb, x, y, cw, ch, blend_rgb(fg_color, bg_color, alpha));
+    } else if (codepoint == 0x2594) {               /* Upper 1/8 */
+        fb_fill_rect(fb, x, y, cw, ch / 8 > 0 ? ch / 8 : 1, fg_color);
+    } else if (codepoint == 0x2595) {               /* Right 1/8 */
+        int w = cw / 8 > 0 ? cw / 8 : 1;
+        fb_fill_rect(fb, x + cw - w, y, w, ch, fg_color);
+    } else {                                        /* Quadrants */
+        unsigned q = block_quadrants[codepoint - 0x2596];
+        int mx = cw / 2, my = ch / 2;
+        if (q & 1) fb_fill_rect(fb, x, y, mx, my, fg_color);
+        if (q & 2) fb_fill_rect(fb, x + mx, y, cw - mx, my, fg_color);
+        if (q & 4) fb_fill_rect(fb, x, y + my, mx, ch - my, fg_color);
+        if (q & 8) fb_fill_rect(fb, x + mx, y + my, cw - mx, ch - my, fg_color);
+    }
+}
+
+/* Braille: dots 1-3 and 7 down the left column, 4-6 and 8 down the right */
+static void render_braille(struct framebuffer *fb, uint32_t codepoint, int x, int y,
+                           uint32_t color, int char_width, int char_height) {
+    static const unsigned char dot_col[8] = { 0, 0, 0, 1, 1, 1, 0, 1 };
+    static const unsigned char dot_row[8] = { 0, 1, 2, 0, 1, 2, 3, 3 };
+    unsigned bits = codepoint - 0x2800;
+    int size = char_width / 4 < char_height / 8 ? char_width / 4 : char_height / 8;
+    if (size < 1) size = 1;
+
+    for (int i = 0; i < 8; i++) {
+        if (!(bits & (1u << i))) continue;
+        int cx0 = dot_col[i] * char_width / 2, cx1 = (dot_col[i] + 1) * char_width / 2;
+        int cy0 = dot_row[i] * char_height / 4, cy1 = (dot_row[i] + 1) * char_height / 4;
+        fb_fill_rect(fb, x + (cx0 + cx1 - size) / 2, y + (cy0 + cy1 - size) / 2, size, size, color);
+    }
+}
+
+/* Returns 0 if the codepoint isn't one we draw ourselves */
+int render_procedural(struct framebuffer *fb, uint32_t codepoint, int x, int y,
+                      uint32_t fg_color, uint32_t bg_color, int char_width, int char_height) {
+    if (codepoint >= 0x2500 && codepoint <= 0x257F) {
+        render_box(fb, codepoint, x, y, fg_color, char_width, char_height);
+    } else if (codepoint >= 0x2580 && codepoint <= 0x259F) {
+        render_block(fb, codepoint, x, y, fg_color, bg_color, char_width, char_height);
+    } else if (codepoint >= 0x2800 && codepoint <= 0x28FF) {
+        render_braille(fb, codepoint, x, y, fg_color, char_width, char_height);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/* Stand-in for a glyph still being rasterized: a box outline halfway
+ * between foreground and background */
+static void render_placeholder(struct framebuffer *fb, int x, int y, uint32_t fg_color, uint32_t bg_color,
+                               int char_width, int char_height) {
+    uint32_t color = ((fg_color & 0xFEFEFE) >> 1) + ((bg_color & 0xFEFEFE) >> 1);
+    int x0 = x + 1, y0 = y + char_height / 8;
+    int w = char_width - 2, h = char_height - 2 * (char_height / 8);
+    if (w < 2 || h < 2) return;
+
+    fb_fill_rect(fb, x0, y0, w, 1, color);
+    fb_fill_rect(fb, x0, y0 + h - 1, w, 1, color);
+    fb_fill_rect(fb, x0, y0 + 1, 1, h - 2, color);
+    fb_fill_rect(fb, x0 + w - 1, y0 + 1, 1, h - 2, color);
+}
+
+/* Draw a cell's glyph over its already filled background. Returns 1 if
+ * a placeholder went in its place. */
+int render_glyph(struct framebuffer *fb, struct glyph_cache *cache,
+                 uint32_t codepoint, int bold, int x, int y,
+                 uint32_t fg_color, uint32_t bg_color, int char_width, int char_height) {
+    if (codepoint == 0 || codepoint == ' ' || codepoint == CELL_CONTINUATION) {
+        return 0;
+    }
+    if (render_procedural(fb, codepoint, x, y, fg_color, bg_color, char_width, char_height)) {
+        return 0;
+    }
+
+    struct glyph *g = glyph_cache_lookup(cache, codepoint,
+                                         bold ? GLYPH_STYLE_BOLD : GLYPH_STYLE_REGULAR);
+    if (!g) {
+        return 0;
+    }
+    if (__atomic_load_n(&g->pending, __ATOMIC_ACQUIRE)) {
+        render_placeholder(fb, x, y, fg_color, bg_color, char_width, char_height);
+        return 1;
+    }
+    if (!g->bitmap) {
+        return 0;
+    }
+
+    /* Clip the glyph to its cell so a cell can be redrawn on its own
+     * without leaving or cutting off ink in its neighbours */
+    int x0 = g->x0 > 0 ? g->x0 : 0;
+    int y0 = g->y0 > 0 ? g->y0 : 0;
+    int x1 = g->x0 + g->width < char_width ? g->x0 + g->width : char_width;
+    int y1 = g->y0 + g->height < char_height ? g->y0 + g->height : char_height;
+    if (x0 >= x1 || y0 >= y1) {
+        return 0;
+    }
+
+    fb_draw_bitmap(fb, x + x0, y + y0, g->bitmap, g->width, g->height,
+                   x0 - g->x0, y0 - g->y0, x1 - x0, y1 - y0, fg_color, bg_color);
+    return 0;
+}
+
+void render_char(struct framebuffer *fb, struct glyph_cache *cache,
+                 uint32_t codepoint, int bold, int x, int y,
+                 uint32_t fg_color, uint32_t bg_color, int char_width, int char_height) {
+    fb_fill_rect(fb, x, y, char_width, char_height, bg_color);
+    render_glyph(fb, cache, codepoint, bold, x, y, fg_color, bg_color, char_width, char_height);
+}
+
+/* Cursor overlay, drawn over a cell right after the cell is repainted */
+void render_cursor(struct framebuffer *fb, struct glyph_cache *cache, const struct cell *cell,
+                   const struct attr *attr, int shape, int x, int y, int char_width, int char_height) {
+    uint32_t bg_color = attr_bg(attr);
+    uint32_t color = attr_fg(attr);
+    if (color == bg_color) color ^= 0x00FFFFFF;
+    int thickness = char_height / 9 > 1 ? char_height / 9 : 1;
+
+    switch (shape) {
+        case CURSOR_BLOCK:
+            /* Reverse video */
+            render_char(fb, cache, cell->codepoint, attr->flags & ATTR_BOLD, x, y,
+                        bg_color, color, char_width, char_height);
+            break;
+        case CURSOR_UNDERLINE:
+            fb_fill_rect(fb, x, y + char_height - thickness, char_width, thickness, color);
+            break;
+        case CURSOR_BAR:
+            fb_fill_rect(fb, x, y, thickness, char_height, color);
+            break;
+    }
+}
+
+void term_damage(struct terminal *term, int y, int x0, int x1) {
+    if (y < 0 || y >= TERM_ROWS) return;
+    if (x0 < 0) x0 = 0;
+    if (x1 > TERM_COLS) x1 = TERM_COLS;
+    if (x0 >= x1) return;
+
+    if (term->dirty_x1[y] <= term->dirty_x0[y]) {
+        term->dirty_x0[y] = x0;
+        term->dirty_x1[y] = x1;
+    } else {
+        if (x0 < term->dirty_x0[y]) term->dirty_x0[y] = x0;
+        if (x1 > term->dirty_x1[y]) term->dirty_x1[y] = x1;
+    }
+}
+
+/* Damage whole rows y0..y1 (inclusive) */
+void term_damage_rows(struct terminal *term, int y0, int y1) {
+    for (int y = y0; y <= y1; y++) {
+        term_damage(term, y, 0, TERM_COLS);
+    }
+}
+
+void term_damage_all(struct terminal *term) {
+    term_damage_rows(term, 0, TERM_ROWS - 1);
+}
+
+/* Columns the displayed cell at (x, y) draws: 2 for the left half of a
+ * wide character, 0 for its right half, else 1 */
+static int term_cell_width(struct terminal *term, int y, int x) {
+    const struct cell *row = term_display_row(term, y);
+    const struct row_info *info = term_display_info(term, y);
+    if (x >= info->blank_from) return 1;
+    if (row[x].codepoint == CELL_CONTINUATION) return 0;
+    if (x + 1 < TERM_COLS && x + 1 < info->blank_from && row[x + 1].codepoint == CELL_CONTINUATION) return 2;
+    return 1;
+}
+
+/* Widen a damaged span of row y to whole wide characters, which are
+ * drawn in one piece */
+static void term_widen_span(struct terminal *term, int y, int *x0, int *x1) {
+    if (*x0 > 0 && term_cell_width(term, y, *x0) == 0) (*x0)--;
+    if (*x1 < TERM_COLS && term_cell_width(term, y, *x1) == 0) (*x1)++;
+}
+
+/* Called by the backends before drawing: if the cursor moved or changed
+ * shape since the last frame, both the cell it left and the cell it
+ * entered need redraw. */
+void term_damage_cursor(struct terminal *term, int shape) {
+    if (term->cursor_x == term->drawn_cursor_x && term->cursor_y == term->drawn_cursor_y &&
+        shape == term->drawn_cursor_shape) {
+        return;
+    }
+    term_damage(term, term->drawn_cursor_y, term->drawn_cursor_x, term->drawn_cursor_x + 1);
+    term_damage(term, term->cursor_y, term->cursor_x, term->cursor_x + 1);
+    term->drawn_cursor_x = term->cursor_x;
+    term->drawn_cursor_y = term->cursor_y;
+    term->drawn_cursor_shape = shape;
+}
+
+static int term_cursor_blinks(struct terminal *term) {
+    return term->cursor_visible && (term->cursor_style == 0 || term->cursor_style % 2 == 1);
+}
+
+/* The shape to show at time now; CURSOR_NONE while hidden or blinked off */
+int term_cursor_shape(struct terminal *term, double now) {
+    if (!term->cursor_visible || term->view_offset > 0) return CURSOR_NONE;
+    if (term_cursor_blinks(term) &&
+        (long)((now - term->cursor_blink_epoch) / CURSOR_BLINK_PERIOD) % 2 == 1) {
+        return CURSOR_NONE;
+    }
+    if (term->cursor_style >= 5) return CURSOR_BAR;
+    if (term->cursor_style >= 3) return CURSOR_UNDERLINE;
+    return CURSOR_BLOCK;
+}
+
+/* When the blinking cursor next toggles after now, or 0 if it doesn't blink */
+double term_cursor_deadline(struct terminal *term, double now) {
+    if (!term_cursor_blinks(term)) return 0.0;
+    long phase = (long)((now - term->cursor_blink_epoch) / CURSOR_BLINK_PERIOD);
+    return term->cursor_blink_epoch + (phase + 1) * CURSOR_BLINK_PERIOD;
+}
+
+/* A blank cols x rows grid with rows in order */
+static int grid_alloc(struct cell **cells_out, int **row_index_out, struct row_info **row_info_out,
+                      int cols, int rows) {
+    /* Every row starts as an all-blank tail in attribute 0, so the
+     * cells themselves need no initializing */
+    struct cell *cells = calloc((size_t)rows * cols, sizeof(struct cell));
+    int *row_index = malloc(sizeof(int) * rows);
+    struct row_info *row_info = calloc(rows, sizeof(struct row_info));
+    if (!cells || !row_index || !row_info) {
+        free(cells);
+        free(row_index);
+        free(row_info);
+        return -1;
+    }
+
+    for (int y = 0; y < rows; y++) {
+        row_index[y] = y;
+    }
+    *cells_out = cells;
+    *row_index_out = row_index;
+    *row_info_out = row_info;
+    return 0;
+}
+
+/* Give term a blank cols x rows grid. The old grid is not freed, and
+ * is left in place if allocation fails. */
+static int term_alloc_grid(struct terminal *term, int cols, int rows) {
+    struct cell *cells, *view_cells = malloc(sizeof(struct cell) * rows * cols);
+    int *row_index;
+    struct row_info *row_info;
+    if (!view_cells || grid_alloc(&cells, &row_index, &row_info, cols, rows) < 0) {
+        free(view_cells);
+        return -1;
+    }
+
+    term->cells = cells;
+    term->view_cells = view_cells;
+    term->row_index = row_index;
+    term->row_info = row_info;
+    term->rows = rows;
+    term->cols = cols;
+    return 0;
+}
+
+void term_free(struct terminal *term) {
+    free(term->cells);
+    free(term->view_cells);
+    free(term->row_index);
+    free(term->row_info);
+    free(term->alt_cells);
+    free(term->alt_row_index);
+    free(term->alt_row_info);
+    free(term->history.buf);
+    term->cells = NULL;
+    term->view_cells = NULL;
+    term->row_index = NULL;
+    term->row_info = NULL;
+    term->alt_cells = NULL;
+    term->alt_row_index = NULL;
+    term->alt_row_info = NULL;
+    memset(&term->history, 0, sizeof(term->history));
+}
+
+static void term_swap_grids(struct terminal *term) {
+    struct cell *cells = term->cells;
+    int *row_index = term->row_index;
+    struct row_info *row_info = term->row_info;
+    term->cells = term->alt_cells;
+    term->row_index = term->alt_row_index;
+    term->row_info = term->alt_row_info;
+    term->alt_cells = cells;
+    term->alt_row_index = row_index;
+    term->alt_row_info = row_info;
+}
+
+/* Write row y's blank tail out as cells up to column x1, so the cells
+ * before x1 can be read and written directly */
+static void term_materialize(struct terminal *term, int y, int x1) {
+    struct row_info *info = term_row_info(term, y);
+    if (x1 <= info->blank_from) return;
+
+    struct cell *row = term_row(term, y);
+    for (int x = info->blank_from; x < x1; x++) {
+        row[x].codepoint = ' ';
+        row[x].attr = info->blank_attr;
+    }
+    info->blank_from = x1;
+}
+
+/* Trade the cursor position for the saved one */
+static void term_swap_cursor(struct terminal *term) {
+    int cursor_x = term->cursor_x, cursor_y = term->cursor_y;
+    term->cursor_x = term->saved_cursor_x;
+    term->cursor_y = term->saved_cursor_y;
+    term->saved_cursor_x = cursor_x;
+    term->saved_cursor_y = cursor_y;
+}
+
+int scrollback_init(struct scrollback *sb, size_t bytes) {
+    memset(sb, 0, sizeof(*sb));
+    if (bytes == 0) return 0;
+    sb->buf = malloc(bytes);
+    if (!sb->buf) return -1;
+    sb->size = bytes;
+    return 0;
+}
+
+void scrollback_clear(struct scrollback *sb) {
+    sb->head = 0;
+    sb->used = 0;
+    sb->lines = 0;
+}
+
+/* Copy n bytes in or out of the ring at offset pos, wrapping around */
+static void scrollback_write(struct scrollback *sb, size_t pos, const void *data, size_t n) {
+    size_t first = sb->size - pos < n ? sb->size - pos : n;
+    memcpy(sb->buf + pos, data, first);
+    memcpy(sb->buf, (const unsigned char *)data + first, n - first);
+}
+
+static void scrollback_read(struct scrollback *sb, size_t pos, void *data, size_t n) {
+    size_t first = sb->size - pos < n ? sb->size - pos : n;
+    memcpy(data, sb->buf + pos, first);
+    memcpy((unsigned char *)data + first, sb->buf, n - first);
+}
+
+/* Append a record, evicting the oldest lines to make room */
+static void scrollback_append(struct scrollback *sb, const unsigned char *record, size_t size) {
+    if (size > sb->size) return;
+    while (sb->used + size > sb->size) {
+        uint32_t oldest;
+        scrollback_read(sb, sb->head, &oldest, sizeof(oldest));
+        sb->head = (sb->head + oldest) % sb->size;
+        sb->used -= oldest;
+        sb->lines--;
+    }
+    scrollback_write(sb, (sb->head + sb->used) % sb->size, record, size);
+    sb->used += size;
+    sb->lines++;
+}
+
+/* Offset of the record before the one at pos */
+static size_t scrollback_prev(struct scrollback *sb, size_t pos) {
+    uint32_t size;
+    scrollback_read(sb, (pos + sb->size - sizeof(size)) % sb->size, &size, sizeof(size));
+    return (pos + sb->size - size) % sb->size;
+}
+
+static unsigned attr_hash_slot(uint32_t fg_color, uint32_t bg_color, uint32_t flags) {
+    uint32_t h = (fg_color * 0x9E3779B1u) ^ (bg_color * 0x85EBCA77u) ^ flags;
+    return (h ^ (h >> 16)) & (ATTR_HASH_SIZE - 1);
+}
+
+/*
+ * Drop attribute entries no cell refers to. Live entries keep their
+ * index, so cells and snapshots need no rewriting; the freed indices are
+ * reused by later interning. Called only when the table is full.
+ */
+static void term_sweep_attrs(struct terminal *term) {
+    uint8_t live[MAX_ATTRS] = {0};
+    live[0] = 1;
+    live[term->pen_attr] = 1;
+    live[term->erase_attr] = 1;
+    for (size_t i = 0; i < (size_t)term->rows * term->cols; i++) {
+        live[term->cells[i].attr] = 1;
+    }
+    for (int i = 0; i < term->rows; i++) {
+        live[term->row_info[i].blank_attr] = 1;
+        if (term->alt_row_info) live[term->alt_row_info[i].blank_attr] = 1;
+    }
+    size_t view_rows = term->view_offset < term->rows ? term->view_offset : term->rows;
+    for (size_t i = 0; i < view_rows * term->cols; i++) {
+        live[term->view_cells[i].attr] = 1;
+    }
+    for (size_t i = 0; term->alt_cells && i < (size_t)term->rows * term->cols; i++) {
+        live[term->alt_cells[i].attr] = 1;
+    }
+
+    memset(term->attr_hash, 0, sizeof(term->attr_hash));
+    term->num_attr_free = 0;
+    for (int i = term->num_attrs - 1; i >= 0; i--) {
+        if (!live[i]) {
+            term->attr_free[term->num_attr_free++] = i;
+            continue;
+        }
+        const struct attr *a = &term->attrs[i];
+        unsigned slot = attr_hash_slot(a->fg_color, a->bg_color, a->flags);
+        while (term->attr_hash[slot]) slot = (slot + 1) & (ATTR_HASH_SIZE - 1);
+        term->attr_hash[slot] = i + 1;
+    }
+}
+
+/* Index of an attribute set, adding it to the table if new */
+uint32_t term_intern_attr(struct terminal *term, uint32_t fg_color, uint32_t bg_color, uint32_t flags) {
+    unsigned slot = attr_hash_slot(fg_color, bg_color, flags);
+    while (term->attr_hash[slot]) {
+        uint32_t id = term->attr_hash[slot] - 1;
+        const struct attr *a = &term->attrs[id];
+        if (a->fg_color == fg_color && a->bg_color == bg_color && a->flags == flags) {
+            return id;
+        }
+        slot = (slot + 1) & (ATTR_HASH_SIZE - 1);
+    }
+
+    if (term->num_attr_free == 0 && term->num_attrs == MAX_ATTRS) {
+        term_sweep_attrs(term);
+        if (term->num_attr_free == 0) return 0;  /* Every entry is on screen */
+        return term_intern_attr(term, fg_color, bg_color, flags);
+    }
+
+    uint32_t id = term->num_attr_free > 0 ? term->attr_free[--term->num_attr_free]
+                                          : (uint32_t)term->num_attrs++;
+    term->attrs[id].fg_color = fg_color;
+    term->attrs[id].bg_color = bg_color;
+    term->attrs[id].flags = flags;
+    term->attr_hash[slot] = id + 1;
+    if ((int)id < term->attr_dirty_lo) term->attr_dirty_lo = id;
+    if ((int)id + 1 > term->attr_dirty_hi) term->attr_dirty_hi = id + 1;
+    return id;
+}
+
+/* Intern the pen after SGR changed it */
+static inline void term_update_pen(struct terminal *term) {
+    if (term->pen_valid) return;
+    term->pen_attr = term_intern_attr(term, term->fg_color, term->bg_color, term->attr_flags);
+    term->erase_attr = term_intern_attr(term, term->fg_color, term->bg_color, 0);
+    term->pen_valid = 1;
+}
+
+/* Rows top..bottom move up by lines (down if negative) by rotating their
+ * row_index entries; the rows that wrap around keep stale cells for the
+ * caller to clear or overwrite */
+void term_rotate_rows(struct terminal *term, int top, int bottom, int lines) {
+    int count = bottom - top + 1;
+    if (count <= 0) return;
+    int shift = ((lines % count) + count) % count;
+    if (shift == 0) return;
+
+    int rotated[MAX_TERM_ROWS];
+    for (int i = 0; i < count; i++) {
+        rotated[i] = term->row_index[top + (i + shift) % count];
+    }
+    memcpy(&term->row_index[top], rotated, sizeof(int) * count);
+}
+
+/*
+ * Record that rows top..bottom scrolled up by lines (down if negative).
+ * Per-row damage moves along with the content and the exposed rows are
+ * damaged, so after the backend applies the move every clean row on
+ * screen still matches the grid. Only one region can have a pending
+ * move; a scroll of any other region is plain damage.
+ */
+void term_damage_scroll(struct terminal *term, int top, int bottom, int lines) {
+    if (lines == 0) return;
+    if (top > bottom) {
+        term_damage_rows(term, bottom, top);
+        return;
+    }
+
+    if (term->move_lines != 0 && (term->move_top != top || term->move_bottom != bottom)) {
+        term_damage_rows(term, top, bottom);
+        return;
+    }
+
+    int height = bottom - top + 1;
+    int total = term->move_lines + lines;
+    if (lines >= height || -lines >= height || total >= height || -total >= height) {
+        /* Everything in the region was replaced; nothing worth moving */
+        term_damage_rows(term, top, bottom);
+        term->move_lines = 0;
+        return;
+    }
+
+    if (lines > 0) {
+        for (int y = top; y <= bottom - lines; y++) {
+            term->dirty_x0[y] = term->dirty_x0[y + lines];
+            term->dirty_x1[y] = term->dirty_x1[y + lines];
+        }
+        for (int y = bottom - lines + 1; y <= bottom; y++) {
+            term->dirty_x0[y] = 0;
+            term->dirty_x1[y] = 0;
+        }
+        term_damage_rows(term, bottom - lines + 1, bottom);
+    } else {
+        for (int y = bottom; y >= top - lines; y--) {
+            term->dirty_x0[y] = term->dirty_x0[y + lines];
+            term->dirty_x1[y] = term->dirty_x1[y + lines];
+        }
+        for (int y = top; y < top - lines; y++) {
+            term->dirty_x0[y] = 0;
+            term->dirty_x1[y] = 0;
+        }
+        term_damage_rows(term, top, top - lines - 1);
+    }
+
+    term->move_top = top;
+    term->move_bottom = bottom;
+    term->move_lines = total;
+}
+
+/* For backends that cannot move pixels: repaint the scrolled region */
+void term_damage_flatten_scroll(struct terminal *term) {
+    if (term->move_lines == 0) return;
+    term_damage_rows(term, term->move_top, term->move_bottom);
+    term->move_lines = 0;
+}
+
+static void term_damage_clear(struct terminal *term, int y) {
+    term->dirty_x0[y] = 0;
+    term->dirty_x1[y] = 0;
+}
+
+/*
+ * Bring snap's grid up to date with term and hand term's damage,
+ * including a pending scroll, over to snap. Only damaged rows are
+ * copied, along with attribute table entries interned since the last
+ * snapshot; live entries never change index, so snap's undamaged cells
+ * stay valid. A backend can then draw snap while term keeps parsing; since
+ * every escape sequence is applied in full by the byte that ends it,
+ * a snapshot taken between bytes is always consistent.
+ */
+void term_snapshot(struct terminal *snap, struct terminal *term) {
+    if (snap->cols != term->cols || snap->rows != term->rows) {
+        /* Resized: start over with a fresh grid and copy it all */
+        struct cell *cells = snap->cells;
+        struct cell *view_cells = snap->view_cells;
+        int *row_index = snap->row_index;
+        struct row_info *row_info = snap->row_info;
+        if (term_alloc_grid(snap, term->cols, term->rows) < 0) return;
+        free(cells);
+        free(view_cells);
+        free(row_index);
+        free(row_info);
+        term->move_lines = 0;
+        term_damage_all(term);
+    }
+
+    if (term->move_lines != 0) {
+        int top = term->move_top;
+        int bottom = term->move_bottom;
+        int lines = term->move_lines;
+        term_rotate_rows(snap, top, bottom, lines);
+        term_damage_scroll(snap, top, bottom, lines);
+        term->move_lines = 0;
+    }
+
+    for (int y = 0; y < TERM_ROWS; y++) {
+        int x0 = term->dirty_x0[y];
+        int x1 = term->dirty_x1[y];
+        if (x1 <= x0) continue;
+
+        /* Take over term's blank tail. Undamaged cells before it must
+         * keep their look, so write out any of snap's old tail there. */
+        const struct row_info *info = term_display_info(term, y);
+        int blank_from = info->blank_from < TERM_COLS ? info->blank_from : TERM_COLS;
+        term_materialize(snap, y, blank_from);
+        *term_row_info(snap, y) = *info;
+        int copy_x1 = x1 < blank_from ? x1 : blank_from;
+        if (copy_x1 > x0) {
+            memcpy(&term_row(snap, y)[x0], &term_display_row(term, y)[x0],
+                   sizeof(struct cell) * (copy_x1 - x0));
+        }
+        term_damage(snap, y, x0, x1);
+        term_damage_clear(term, y);
+    }
+
+    if (term->attr_dirty_hi > term->attr_dirty_lo) {
+        memcpy(&snap->attrs[term->attr_dirty_lo], &term->attrs[term->attr_dirty_lo],
+               sizeof(struct attr) * (term->attr_dirty_hi - term->attr_dirty_lo));
+        term->attr_dirty_lo = MAX_ATTRS;
+        term->attr_dirty_hi = 0;
+    }
+
+    snap->cursor_x = term->cursor_x;
+    snap->cursor_y = term->cursor_y;
+    snap->cursor_visible = term->cursor_visible && term->view_offset == 0;
+    snap->cursor_style = term->cursor_style;
+}
+
+/* Before cells from column x on change: a wide character across x
+ * would lose a half, so it is blanked whole */
+static void term_split_wide(struct terminal *term, int y, int x) {
+    if (x <= 0 || x >= TERM_COLS || x >= term_row_info(term, y)->blank_from) return;
+
+    struct cell *row = term_row(term, y);
+    if (row[x].codepoint != CELL_CONTINUATION) return;
+    row[x - 1].codepoint = ' ';
+    row[x].codepoint = ' ';
+    term_damage(term, y, x - 1, x + 1);
+}
+
+/* Blank columns x0..x1-1 of row y in the current colors. Blanking to
+ * the end of the row only moves its blank tail, and also ends its line
+ * there unless nothing is left to blank. */
+void term_clear_cells(struct terminal *term, int y, int x0, int x1) {
+    term_update_pen(term);
+    term_split_wide(term, y, x0);
+    term_split_wide(term, y, x1);
+    struct row_info *info = term_row_info(term, y);
+    if (x1 >= TERM_COLS) {
+        if (x0 < info->blank_from || info->blank_attr != term->erase_attr) {
+            term_materialize(term, y, x0);
+            info->blank_from = x0;
+            info->blank_attr = term->erase_attr;
+        }
+        if (x0 < TERM_COLS) info->wrapped = 0;
+        return;
+    }
+
+    if (x0 >= info->blank_from && info->blank_attr == term->erase_attr) return;
+    term_materialize(term, y, x1);
+    struct cell *row = term_row(term, y);
+    for (int x = x0; x < x1; x++) {
+        row[x].codepoint = ' ';
+        row[x].attr = term->erase_attr;
+    }
+}
+
+/* EL 1, and ED 1 on the cursor row: blank up to and including the
+ * cursor. The line goes on past it even when that reaches the last
+ * column. */
+static void term_clear_to_cursor(struct terminal *term) {
+    struct row_info *info = term_row_info(term, term->cursor_y);
+    int wrapped = info->wrapped;
+    term_clear_cells(term, term->cursor_y, 0, term->cursor_x + 1);
+    info->wrapped = wrapped;
+    term_damage(term, term->cursor_y, 0, term->cursor_x + 1);
+}
+
+/* A blank cell at the end of a line, not worth keeping */
+static inline int cell_is_blank(const struct cell *c) {
+    return (c->codepoint == ' ' || c->codepoint == 0) && c->attr == 0;
+}
+
+/* Cells in old row y up to its last non-blank one */
+static int term_row_length(const struct cell *row, int cols) {
+    while (cols > 0 && cell_is_blank(&row[cols - 1])) cols--;
+    return cols;
+}
+
+/* Pack a row into a scrollback record */
+void term_push_history(struct terminal *term, const struct cell *row, int cols, int wrapped) {
+    if (term->history.size == 0) return;
+
+    unsigned char record[sizeof(struct sb_line) + MAX_TERM_COLS * (sizeof(struct sb_span) + 4) +
+                         sizeof(uint32_t)];
+    int num_cells = term_row_length(row, cols);
+    struct sb_line line = { 0, num_cells, 0, wrapped };
+    size_t pos = sizeof(line);
+
+    for (int x = 0; x < num_cells; ) {
+        struct sb_span span = { 1, term->attrs[row[x].attr] };
+        while (x + span.count < num_cells && row[x + span.count].attr == row[x].attr) span.count++;
+        memcpy(record + pos, &span, sizeof(span));
+        pos += sizeof(span);
+        line.num_spans++;
+        x += span.count;
+    }
+    for (int x = 0; x < num_cells; x++) {
+        if (row[x].codepoint == CELL_CONTINUATION) continue;
+        pos += codepoint_to_utf8(row[x].codepoint ? row[x].codepoint : ' ', (char *)record + pos);
+    }
+
+    line.size = pos + sizeof(uint32_t);
+    memcpy(record, &line, sizeof(line));
+    memcpy(record + pos, &line.size, sizeof(uint32_t));
+    scrollback_append(&term->history, record, line.size);
+}
+
+/* Unpack the record at pos into a row of cols cells */
+static void term_read_history(struct terminal *term, size_t pos, struct cell *row, int cols) {
+    unsigned char record[sizeof(struct sb_line) + MAX_TERM_COLS * (sizeof(struct sb_span) + 4) +
+                         sizeof(uint32_t) + 1];
+    struct sb_line line;
+    scrollback_read(&term->history, pos, &line, sizeof(line));
+    scrollback_read(&term->history, pos, record, line.size);
+    record[line.size - sizeof(uint32_t)] = 0;
+
+    const unsigned char *text = record + sizeof(line) + line.num_spans * sizeof(struct sb_span);
+    int x = 0, wide = 0;
+    for (int i = 0; i < line.num_spans; i++) {
+        struct sb_span span;
+        memcpy(&span, record + sizeof(line) + i * sizeof(span), sizeof(span));
+        uint32_t attr = term_intern_attr(term, span.attr.fg_color, span.attr.bg_color, span.attr.flags);
+        for (int k = 0; k < span.count; k++, x++) {
+            /* A wide character's continuation is implied */
+            uint32_t codepoint = wide ? CELL_CONTINUATION : utf8_decode(&text);
+            wide = !wide && codepoint_width(codepoint) == 2;
+            if (wide && x == cols - 1) codepoint = ' ';  /* Cut off by a narrower screen */
+            if (x < cols) {
+                row[x].codepoint = codepoint;
+                row[x].attr = attr;
+            }
+        }
+    }
+    for (; x < cols; x++) {
+        row[x].codepoint = ' ';
+        row[x].attr = 0;
+    }
+}
+
+/* Move the view lines further back into history, or forward if negative */
+void term_view_scroll(struct terminal *term, int lines) {
+    long offset = (long)term->view_offset + lines;
+    if (offset > (long)term->history.lines) offset = term->history.lines;
+    if (offset < 0) offset = 0;
+    if (offset == term->view_offset) return;
+    term->view_offset = offset;
+
+    /* Walk back to the first line shown, then unpack forwards */
+    int shown = offset < term->rows ? offset : term->rows;
+    size_t pos = (term->history.head + term->history.used) % term->history.size;
+    for (long i = 0; i < offset; i++) pos = scrollback_prev(&term->history, pos);
+    for (int y = 0; y < shown; y++) {
+        term_read_history(term, pos, &term->view_cells[(size_t)y * term->cols], term->cols);
+        uint32_t size;
+        scrollback_read(&term->history, pos, &size, sizeof(size));
+        pos = (pos + size) % term->history.size;
+    }
+
+    term_damage_flatten_scroll(term);
+    term_damage_all(term);
+}
+
+int term_init(struct terminal *term) {
+    memset(term, 0, sizeof(*term));
+    if (term_alloc_grid(term, TERM_COLS, TERM_ROWS) < 0) return -1;
+    term->fg_color = 0x00FFFFFF;
+    term->bg_color = 0x00000000;
+    term->scroll_bottom = TERM_ROWS - 1;
+    term->cursor_visible = 1;
+    term->utf8_buf_len = 0;
+    term->master_fd = -1;
+    term->attr_dirty_lo = MAX_ATTRS;
+
+    /* Index 0, what new grids are filled with, is the default pen */
+    term_intern_attr(term, term->fg_color, term->bg_color, 0);
+    term_damage_all(term);
+    return 0;
+}
+
+/* A copy of term with a grid of its own, for snapshots */
+int term_clone(struct terminal *copy, struct terminal *term) {
+    *copy = *term;
+    memset(&copy->history, 0, sizeof(copy->history));
+    copy->view_offset = 0;
+    copy->alt_cells = NULL;
+    copy->alt_row_index = NULL;
+    copy->alt_row_info = NULL;
+    if (term_alloc_grid(copy, term->cols, term->rows) < 0) return -1;
+    memcpy(copy->cells, term->cells, sizeof(struct cell) * term->rows * term->cols);
+    memcpy(copy->row_index, term->row_index, sizeof(int) * term->rows);
+    memcpy(copy->row_info, term->row_info, sizeof(struct row_info) * term->rows);
+    return 0;
+}
+
+/*
+ * Resize the grid to cols x rows. Rows joined by soft wraps form one
+ * line that is wrapped again at the new width, and the cursor keeps its
+ * place in its line. If the result is taller than the screen, lines go
+ * off the top into the scrollback as long as the cursor stays on screen.
+ *
+ * The alternate screen is not reflowed: it comes back blank, for the
+ * full-screen program to redraw on SIGWINCH, while the main screen
+ * behind it is reflowed around the saved cursor.
+ */
+/* Cells of a reflowed line that go on its next row: as many as fit,
+ * less one when that would cut a wide character in two, which then
+ * wraps whole as it does when printed */
+static int reflow_row_cells(const struct cell *line, int len, int cols) {
+    if (len <= cols) return len;
+    if (cols >= 2 && line[cols].codepoint == CELL_CONTINUATION) return cols - 1;
+    return cols;
+}
+
+int term_resize(struct terminal *term, int cols, int rows) {
+    if (cols > MAX_TERM_COLS) cols = MAX_TERM_COLS;
+    if (rows > MAX_TERM_ROWS) rows = MAX_TERM_ROWS;
+    if (cols < 1) cols = 1;
+    if (rows < 1) rows = 1;
+    if (cols == term->cols && rows == term->rows) return 0;
+
+    /* Each line gathered into one run of cells, plus room for the
+     * cursor past the end of the screen */
+    struct cell *line_cells = malloc(((size_t)term->rows * term->cols + 1) * sizeof(struct cell));
+    if (!line_cells) return -1;
+    term->view_offset = 0;
+
+    struct cell *alt_cells;
+    int *alt_row_index;
+    struct row_info *alt_row_info;
+    if (term->alt_screen) {
+        if (grid_alloc(&alt_cells, &alt_row_index, &alt_row_info, cols, rows) < 0) {
+            free(line_cells);
+            return -1;
+        }
+        term_swap_grids(term);
+        term_swap_cursor(term);
+    }
+
+    /* Reflow reads whole rows */
+    for (int y = 0; y < term->rows; y++) {
+        term_materialize(term, y, term->cols);
+    }
+
+    struct cell *old_cells = term->cells;
+    struct cell *old_view_cells = term->view_cells;
+    int *old_index = term->row_index;
+    struct row_info *old_info = term->row_info;
+    int old_cols = term->cols;
+    int old_rows = term->rows;
+#define OLD_ROW(y) (&old_cells[(size_t)old_index[y] * old_cols])
+#define OLD_WRAPPED(y) (old_info[old_index[y]].wrapped)
+
+    int cursor_y = term->cursor_y < old_rows ? term->cursor_y : old_rows - 1;
+    int cursor_x = term->cursor_x;
+
+    /* Blank rows below both the cursor and the text are not kept */
+    int last = cursor_y;
+    for (int y = old_rows - 1; y > last; y--) {
+        if (term_row_length(OLD_ROW(y), old_cols) > 0) {
+            last = y;
+            break;
+        }
+    }
+    while (last < old_rows - 1 && OLD_WRAPPED(last)) last++;
+
+    /* First pass: gather the lines, without the padding wide characters
+     * wrapped away from, and find where they and the cursor land */
+    int line_start[MAX_TERM_ROWS + 1], num_lines = 0, used = 0;
+    int total = 0, new_cursor_row = 0, new_cursor_x = 0;
+    for (int y0 = 0, y1; y0 <= last; y0 = y1 + 1) {
+        for (y1 = y0; y1 < last && OLD_WRAPPED(y1); y1++);
+        int cursor_pos = -1;
+        line_start[num_lines++] = used;
+        for (int y = y0; y <= y1; y++) {
+            const struct cell *src = OLD_ROW(y);
+            int n = y < y1 ? old_cols : term_row_length(src, old_cols);
+            for (int x = 0; x < n; x++) {
+                if (y == cursor_y && x == cursor_x) cursor_pos = used;
+                if (x == old_cols - 1 && y < y1 && src[x].codepoint == CELL_WRAP_PAD) continue;
+                line_cells[used++] = src[x];
+            }
+            if (y == cursor_y && cursor_x >= n) cursor_pos = used + cursor_x - n;
+        }
+        /* The line reaches at least to the cursor */
+        while (used <= cursor_pos) line_cells[used++] = (struct cell){ ' ', 0 };
+
+        int pos = line_start[num_lines - 1];
+        do {
+            int n = reflow_row_cells(&line_cells[pos], used - pos, cols);
+            if (cursor_pos >= pos && cursor_pos < pos + n) {
+                new_cursor_row = total;
+                new_cursor_x = cursor_pos - pos;
+            }
+            pos += n;
+            total++;
+        } while (pos < used);
+    }
+    line_start[num_lines] = used;
+    int drop = total - rows;
+    if (drop > new_cursor_row) drop = new_cursor_row;
+    if (drop < 0) drop = 0;
+
+    if (term_alloc_grid(term, cols, rows) < 0) {
+        free(line_cells);
+        if (term->alt_screen) {
+            term_swap_grids(term);
+            term_swap_cursor(term);
+            free(alt_cells);
+            free(alt_row_index);
+            free(alt_row_info);
+        }
+        return -1;
+    }
+
+    /* Second pass: lay out the lines that are still on screen */
+    int row = 0;
+    for (int i = 0; i < num_lines && row - drop < rows; i++) {
+        int pos = line_start[i], end = line_start[i + 1];
+        do {
+            int y = row++ - drop;
+            if (y >= rows) break;
+            int n = reflow_row_cells(&line_cells[pos], end - pos, cols);
+            struct cell scrolled[MAX_TERM_COLS];
+            struct cell *dst = y >= 0 ? term_row(term, y) : scrolled;
+            memcpy(dst, &line_cells[pos], n * sizeof(struct cell));
+            pos += n;
+            int x = n, wrapped = pos < end;
+            if (x < cols && wrapped) {
+                /* The wide character that did not fit starts the next row */
+                dst[x].codepoint = CELL_WRAP_PAD;
+                dst[x++].attr = line_cells[pos].attr;
+            }
+            /* Only a one column screen still cuts a wide character */
+            if (x > 0 && dst[0].codepoint == CELL_CONTINUATION) dst[0].codepoint = ' ';
+            if (x == cols && codepoint_width(dst[x - 1].codepoint) == 2) dst[x - 1].codepoint = ' ';
+            if (y < 0) {
+                term_push_history(term, scrolled, x, wrapped);
+                continue;
+            }
+            /* The rest of the row is the fresh grid's blank tail */
+            term_row_info(term, y)->blank_from = x;
+            term_row_info(term, y)->wrapped = wrapped;
+        } while (pos < end);
+    }
+#undef OLD_ROW
+#undef OLD_WRAPPED
+
+    free(line_cells);
+    free(old_cells);
+    free(old_view_cells);
+    free(old_index);
+    free(old_info);
+
+    TERM_COLS = cols;
+    TERM_ROWS = rows;
+    term->cursor_y = new_cursor_row - drop;
+    term->cursor_x = new_cursor_x;
+
+    free(term->alt_cells);
+    free(term->alt_row_index);
+    free(term->alt_row_info);
+    term->alt_cells = NULL;
+    term->alt_row_index = NULL;
+    term->alt_row_info = NULL;
+    if (term->alt_screen) {
+        /* Swap back: the saved cursor is the main screen's again */
+        term->alt_cells = alt_cells;
+        term->alt_row_index = alt_row_index;
+        term->alt_row_info = alt_row_info;
+        term_swap_grids(term);
+        term_swap_cursor(term);
+        if (term->cursor_x >= cols) term->cursor_x = cols - 1;
+        if (term->cursor_y >= rows) term->cursor_y = rows - 1;
+    }
+    term->scroll_top = 0;
+    term->scroll_bottom = rows - 1;
+    term->move_lines = 0;
+    memset(term->dirty_x0, 0, sizeof(term->dirty_x0));
+    memset(term->dirty_x1, 0, sizeof(term->dirty_x1));
+    memset(term->stub_x0, 0, sizeof(term->stub_x0));
+    memset(term->stub_x1, 0, sizeof(term->stub_x1));
+    term_damage_all(term);
+    return 0;
+}
+
+void term_scroll_up(struct terminal *term) {
+    if (term->scroll_top == 0 && !term->alt_screen) {
+        /* A tail in the default colors is trimmed off anyway */
+        struct row_info *info = term_row_info(term, 0);
+        if (info->blank_attr != 0) term_materialize(term, 0, TERM_COLS);
+        int cols = info->blank_from < TERM_COLS ? info->blank_from : TERM_COLS;
+        term_push_history(term, term_row(term, 0), cols, info->wrapped);
+    }
+    term_rotate_rows(term, term->scroll_top, term->scroll_bottom, 1);
+    term_clear_cells(term, term->scroll_bottom, 0, TERM_COLS);
+    term_damage_scroll(term, term->scroll_top, term->scroll_bottom, 1);
+}
+
+void term_scroll_down(struct terminal *term) {
+    term_rotate_rows(term, term->scroll_top, term->scroll_bottom, -1);
+    term_clear_cells(term, term->scroll_top, 0, TERM_COLS);
+    term_damage_scroll(term, term->scroll_top, term->scroll_bottom, -1);
 }
 
 void term_newline(struct terminal *term) {
@@ -428,22 +3530,123 @@ void term_carriage_return(struct terminal *term) {
     term->cursor_x = 0;
 }
 
-void term_putchar(struct terminal *term, uint32_t codepoint) {
-    if (term->cursor_x >= TERM_COLS) {
-        term_carriage_return(term);
-        term_newline(term);
+void term_putchar(struct terminal *term, uint32_t codepoint) {
+    if (codepoint >= 0x110000) codepoint = 0xFFFD;
+    int width = codepoint_width(codepoint);
+
+    /* A cell holds one codepoint, so combining marks and other
+     * zero-width characters are dropped; columns still line up with
+     * what the program counted */
+    if (width == 0) return;
+    if (width == 2 && TERM_COLS < 2) {
+        codepoint = 0xFFFD;
+        width = 1;
+    }
+
+    if (term->cursor_x + width > TERM_COLS) {
+        /* A wide character that does not fit wraps whole, leaving the
+         * last column blank */
+        if (term->cursor_x < TERM_COLS) {
+            term_clear_cells(term, term->cursor_y, term->cursor_x, TERM_COLS);
+            term_materialize(term, term->cursor_y, TERM_COLS);
+            term_row(term, term->cursor_y)[term->cursor_x].codepoint = CELL_WRAP_PAD;
+            term_damage(term, term->cursor_y, term->cursor_x, TERM_COLS);
+        }
+        term_row_info(term, term->cursor_y)->wrapped = 1;
+        term_carriage_return(term);
+        term_newline(term);
+    }
+
+    if (term->cursor_y >= TERM_ROWS) {
+        term->cursor_y = TERM_ROWS - 1;
+    }
+
+    int x = term->cursor_x, y = term->cursor_y;
+    term_update_pen(term);
+    term_materialize(term, y, x + width);
+    term_split_wide(term, y, x);
+    term_split_wide(term, y, x + width);
+    struct cell *row = term_row(term, y);
+    row[x].codepoint = codepoint;
+    row[x].attr = term->pen_attr;
+    if (width == 2) {
+        row[x + 1].codepoint = CELL_CONTINUATION;
+        row[x + 1].attr = term->pen_attr;
+    }
+    term_damage(term, y, x, x + width);
+
+    term->cursor_x += width;
+}
+
+/* DECSC: the cursor position and the pen */
+void term_save_cursor(struct terminal *term) {
+    term->saved_cursor_x = term->cursor_x;
+    term->saved_cursor_y = term->cursor_y;
+    term->saved_fg_color = term->fg_color;
+    term->saved_bg_color = term->bg_color;
+    term->saved_attr_flags = term->attr_flags;
+}
+
+/* DECRC */
+void term_restore_cursor(struct terminal *term) {
+    term->cursor_x = term->saved_cursor_x < TERM_COLS ? term->saved_cursor_x : TERM_COLS - 1;
+    term->cursor_y = term->saved_cursor_y < TERM_ROWS ? term->saved_cursor_y : TERM_ROWS - 1;
+    term->fg_color = term->saved_fg_color;
+    term->bg_color = term->saved_bg_color;
+    term->attr_flags = term->saved_attr_flags;
+    term->pen_valid = 0;
+}
+
+/*
+ * Show the alternate screen, or the main one again, by swapping grids.
+ * Only cells that differ between the two are damaged, so leaving a
+ * full-screen program repaints just what it covered.
+ */
+void term_switch_screen(struct terminal *term, int alt) {
+    if (alt == term->alt_screen) return;
+    if (!term->alt_cells && grid_alloc(&term->alt_cells, &term->alt_row_index,
+                                       &term->alt_row_info, term->cols, term->rows) < 0) {
+        return;
     }
 
-    if (term->cursor_y >= TERM_ROWS) {
-        term->cursor_y = TERM_ROWS - 1;
-    }
+    /* Damage is relative to the grid being hidden */
+    term_damage_flatten_scroll(term);
+    term_swap_grids(term);
+    term->alt_screen = alt;
 
-    term->cells[term->cursor_y][term->cursor_x].codepoint = codepoint;
-    term->cells[term->cursor_y][term->cursor_x].fg_color = term->fg_color;
-    term->cells[term->cursor_y][term->cursor_x].bg_color = term->bg_color;
-    term->cells[term->cursor_y][term->cursor_x].bold = term->bold;
+    for (int y = 0; y < TERM_ROWS; y++) {
+        const struct cell *shown = term_row(term, y);
+        const struct cell *hidden = &term->alt_cells[(size_t)term->alt_row_index[y] * term->cols];
+        const struct row_info *shown_info = term_row_info(term, y);
+        const struct row_info *hidden_info = &term->alt_row_info[term->alt_row_index[y]];
+
+        /* Where both rows are blank tails in the same colors they agree */
+        int x0 = 0, x1 = TERM_COLS;
+        if (shown_info->blank_attr == hidden_info->blank_attr) {
+            int tail = shown_info->blank_from > hidden_info->blank_from ?
+                       shown_info->blank_from : hidden_info->blank_from;
+            if (tail < x1) x1 = tail;
+        }
+        while (x0 < x1 && cells_equal(row_cell(shown, shown_info, x0), row_cell(hidden, hidden_info, x0))) {
+            x0++;
+        }
+        while (x1 > x0 && cells_equal(row_cell(shown, shown_info, x1 - 1),
+                                      row_cell(hidden, hidden_info, x1 - 1))) {
+            x1--;
+        }
+        term_damage(term, y, x0, x1);
+    }
+}
 
-    term->cursor_x++;
+/* Blank the alternate screen while the main one is showing */
+void term_clear_alt(struct terminal *term) {
+    if (!term->alt_cells || term->alt_screen) return;
+    term_update_pen(term);
+    for (int i = 0; i < term->rows; i++) {
+        term->alt_row_info[i].blank_from = 0;
+        term->alt_row_info[i].wrapped = 0;
+        term->alt_row_info[i].blank_attr = term->erase_attr;
+    }
 }
 
 void term_handle_csi(struct terminal *term, char final) {
@@ -481,86 +3684,70 @@ void term_handle_csi(struct terminal *term, char final) {
         case 'J': /* Erase Display */
             if (n == 0 || p[0] == 0) {
                 /* Clear from cursor to end */
-                for (int x = term->cursor_x; x < TERM_COLS; x++) {
-                    term->cells[term->cursor_y][x].codepoint = ' ';
-                    term->cells[term->cursor_y][x].fg_color = term->fg_color;
-                    term->cells[term->cursor_y][x].bg_color = term->bg_color;
-                }
+                term_clear_cells(term, term->cursor_y, term->cursor_x, TERM_COLS);
                 for (int y = term->cursor_y + 1; y < TERM_ROWS; y++) {
-                    for (int x = 0; x < TERM_COLS; x++) {
-                        term->cells[y][x].codepoint = ' ';
-                        term->cells[y][x].fg_color = term->fg_color;
-                        term->cells[y][x].bg_color = term->bg_color;
-                    }
+                    term_clear_cells(term, y, 0, TERM_COLS);
                 }
+                term_damage(term, term->cursor_y, term->cursor_x, TERM_COLS);
+                term_damage_rows(term, term->cursor_y + 1, TERM_ROWS - 1);
             } else if (p[0] == 1) {
                 /* Clear from beginning to cursor */
                 for (int y = 0; y < term->cursor_y; y++) {
-                    for (int x = 0; x < TERM_COLS; x++) {
-                        term->cells[y][x].codepoint = ' ';
-                        term->cells[y][x].fg_color = term->fg_color;
-                        term->cells[y][x].bg_color = term->bg_color;
-                    }
-                }
-                for (int x = 0; x <= term->cursor_x; x++) {
-                    term->cells[term->cursor_y][x].codepoint = ' ';
-                    term->cells[term->cursor_y][x].fg_color = term->fg_color;
-                    term->cells[term->cursor_y][x].bg_color = term->bg_color;
+                    term_clear_cells(term, y, 0, TERM_COLS);
                 }
+                term_clear_to_cursor(term);
+                term_damage_rows(term, 0, term->cursor_y - 1);
             } else if (p[0] == 2 || p[0] == 3) {
                 /* Clear entire screen (3 also clears scrollback) */
                 for (int y = 0; y < TERM_ROWS; y++) {
-                    for (int x = 0; x < TERM_COLS; x++) {
-                        term->cells[y][x].codepoint = ' ';
-                        term->cells[y][x].fg_color = term->fg_color;
-                        term->cells[y][x].bg_color = term->bg_color;
-                    }
+                    term_clear_cells(term, y, 0, TERM_COLS);
                 }
+                if (p[0] == 3) scrollback_clear(&term->history);
+                term_damage_all(term);
             }
             break;
 
         case 'K': /* Erase Line */
             if (n == 0 || p[0] == 0) {
                 /* Clear from cursor to end of line */
-                for (int x = term->cursor_x; x < TERM_COLS; x++) {
-                    term->cells[term->cursor_y][x].codepoint = ' ';
-                    term->cells[term->cursor_y][x].fg_color = term->fg_color;
-                    term->cells[term->cursor_y][x].bg_color = term->bg_color;
-                }
+                term_clear_cells(term, term->cursor_y, term->cursor_x, TERM_COLS);
+                term_damage(term, term->cursor_y, term->cursor_x, TERM_COLS);
             } else if (p[0] == 1) {
                 /* Clear from beginning to cursor */
-                for (int x = 0; x <= term->cursor_x; x++) {
-                    term->cells[term->cursor_y][x].codepoint = ' ';
-                    term->cells[term->cursor_y][x].fg_color = term->fg_color;
-                    term->cells[term->cursor_y][x].bg_color = term->bg_color;
-                }
+                term_clear_to_cursor(term);
             } else if (p[0] == 2) {
                 /* Clear entire line */
-                for (int x = 0; x < TERM_COLS; x++) {
-                    term->cells[term->cursor_y][x].codepoint = ' ';
-                    term->cells[term->cursor_y][x].fg_color = term->fg_color;
-                    term->cells[term->cursor_y][x].bg_color = term->bg_color;
-                }
+                term_clear_cells(term, term->cursor_y, 0, TERM_COLS);
+                term_damage(term, term->cursor_y, 0, TERM_COLS);
             }
             break;
 
         case 'm': /* SGR - Select Graphic Rendition */
+            term->pen_valid = 0;
             if (n == 0) {
                 /* No parameters = reset */
                 term->fg_color = 0x00FFFFFF;
                 term->bg_color = 0x00000000;
-                term->bold = 0;
+                term->attr_flags = 0;
             }
             for (int i = 0; i < n; i++) {
                 if (p[i] == 0) {
                     /* Reset */
                     term->fg_color = 0x00FFFFFF;
                     term->bg_color = 0x00000000;
-                    term->bold = 0;
+                    term->attr_flags = 0;
                 } else if (p[i] == 1) {
-                    term->bold = 1;
+                    term->attr_flags |= ATTR_BOLD;
                 } else if (p[i] == 22) {
-                    term->bold = 0;
+                    term->attr_flags &= ~ATTR_BOLD;
+                } else if (p[i] == 4) {
+                    term->attr_flags |= ATTR_UNDERLINE;
+                } else if (p[i] == 24) {
+                    term->attr_flags &= ~ATTR_UNDERLINE;
+                } else if (p[i] == 7) {
+                    term->attr_flags |= ATTR_INVERSE;
+                } else if (p[i] == 27) {
+                    term->attr_flags &= ~ATTR_INVERSE;
                 } else if (p[i] >= 30 && p[i] <= 37) {
                     /* Foreground color */
                     term->fg_color = color_palette[p[i] - 30];
@@ -590,8 +3777,13 @@ void term_handle_csi(struct terminal *term, char final) {
                     if (p[i] == 25) {
                         /* Show cursor */
                         term->cursor_visible = 1;
-                    } else if (p[i] == 1049 || p[i] == 47 || p[i] == 1047) {
-                        /* Alternate screen buffer - we don't implement this, just ignore */
+                    } else if (p[i] == 1049) {
+                        /* Alternate screen, cleared, saving the cursor */
+                        term_save_cursor(term);
+                        term_clear_alt(term);
+                        term_switch_screen(term, 1);
+                    } else if (p[i] == 47 || p[i] == 1047) {
+                        term_switch_screen(term, 1);
                     }
                     /* Ignore other modes */
                 }
@@ -605,8 +3797,15 @@ void term_handle_csi(struct terminal *term, char final) {
                     if (p[i] == 25) {
                         /* Hide cursor */
                         term->cursor_visible = 0;
-                    } else if (p[i] == 1049 || p[i] == 47 || p[i] == 1047) {
-                        /* Exit alternate screen buffer - we don't implement this, just ignore */
+                    } else if (p[i] == 1049) {
+                        term_switch_screen(term, 0);
+                        term_restore_cursor(term);
+                    } else if (p[i] == 1047) {
+                        /* Back to the main screen, clearing the alternate one */
+                        term_switch_screen(term, 0);
+                        term_clear_alt(term);
+                    } else if (p[i] == 47) {
+                        term_switch_screen(term, 0);
                     }
                     /* Ignore other modes */
                 }
@@ -645,67 +3844,71 @@ void term_handle_csi(struct terminal *term, char final) {
         case 'L': /* Insert Line */
             /* Insert blank line at cursor, shift down */
             for (int i = 0; i < ((n > 0 && p[0] > 0) ? p[0] : 1); i++) {
-                for (int y = term->scroll_bottom; y > term->cursor_y; y--) {
-                    memcpy(term->cells[y], term->cells[y - 1], sizeof(struct cell) * TERM_COLS);
-                }
-                for (int x = 0; x < TERM_COLS; x++) {
-                    term->cells[term->cursor_y][x].codepoint = ' ';
-                    term->cells[term->cursor_y][x].fg_color = term->fg_color;
-                    term->cells[term->cursor_y][x].bg_color = term->bg_color;
-                }
+                term_rotate_rows(term, term->cursor_y, term->scroll_bottom, -1);
+                term_clear_cells(term, term->cursor_y, 0, TERM_COLS);
+            }
+            if (term->cursor_y <= term->scroll_bottom) {
+                term_damage_scroll(term, term->cursor_y, term->scroll_bottom,
+                                   -((n > 0 && p[0] > 0) ? p[0] : 1));
+            } else {
+                term_damage(term, term->cursor_y, 0, TERM_COLS);
             }
             break;
 
         case 'M': /* Delete Line */
             /* Delete line at cursor, shift up */
             for (int i = 0; i < ((n > 0 && p[0] > 0) ? p[0] : 1); i++) {
-                for (int y = term->cursor_y; y < term->scroll_bottom; y++) {
-                    memcpy(term->cells[y], term->cells[y + 1], sizeof(struct cell) * TERM_COLS);
-                }
-                for (int x = 0; x < TERM_COLS; x++) {
-                    term->cells[term->scroll_bottom][x].codepoint = ' ';
-                    term->cells[term->scroll_bottom][x].fg_color = term->fg_color;
-                    term->cells[term->scroll_bottom][x].bg_color = term->bg_color;
-                }
+                term_rotate_rows(term, term->cursor_y, term->scroll_bottom, 1);
+                term_clear_cells(term, term->scroll_bottom, 0, TERM_COLS);
+            }
+            if (term->cursor_y <= term->scroll_bottom) {
+                term_damage_scroll(term, term->cursor_y, term->scroll_bottom,
+                                   (n > 0 && p[0] > 0) ? p[0] : 1);
+            } else {
+                term_damage(term, term->scroll_bottom, 0, TERM_COLS);
             }
             break;
 
         case 'X': /* Erase Characters */
             {
                 int count = (n > 0 && p[0] > 0) ? p[0] : 1;
-                for (int i = 0; i < count && term->cursor_x + i < TERM_COLS; i++) {
-                    term->cells[term->cursor_y][term->cursor_x + i].codepoint = ' ';
-                    term->cells[term->cursor_y][term->cursor_x + i].fg_color = term->fg_color;
-                    term->cells[term->cursor_y][term->cursor_x + i].bg_color = term->bg_color;
-                }
+                term_clear_cells(term, term->cursor_y, term->cursor_x,
+                                 term->cursor_x + count < TERM_COLS ? term->cursor_x + count : TERM_COLS);
+                term_damage(term, term->cursor_y, term->cursor_x, term->cursor_x + count);
             }
             break;
 
         case 'P': /* Delete Characters */
             {
                 int count = (n > 0 && p[0] > 0) ? p[0] : 1;
+                if (count > TERM_COLS - term->cursor_x) count = TERM_COLS - term->cursor_x;
+                if (count <= 0) break;  /* At the pending wrap: nothing to delete */
+                term_materialize(term, term->cursor_y, TERM_COLS);
+                term_split_wide(term, term->cursor_y, term->cursor_x);
+                term_split_wide(term, term->cursor_y, term->cursor_x + count);
                 for (int x = term->cursor_x; x < TERM_COLS - count; x++) {
-                    term->cells[term->cursor_y][x] = term->cells[term->cursor_y][x + count];
-                }
-                for (int x = TERM_COLS - count; x < TERM_COLS; x++) {
-                    term->cells[term->cursor_y][x].codepoint = ' ';
-                    term->cells[term->cursor_y][x].fg_color = term->fg_color;
-                    term->cells[term->cursor_y][x].bg_color = term->bg_color;
+                    term_row(term, term->cursor_y)[x] = term_row(term, term->cursor_y)[x + count];
                 }
+                /* The leftovers at the end were moved whole; none of
+                 * them is half of the wide character before them */
+                if (count > 0) term_row(term, term->cursor_y)[TERM_COLS - count].codepoint = ' ';
+                term_clear_cells(term, term->cursor_y, TERM_COLS - count, TERM_COLS);
+                term_damage(term, term->cursor_y, term->cursor_x, TERM_COLS);
             }
             break;
 
         case '@': /* Insert Characters */
             {
                 int count = (n > 0 && p[0] > 0) ? p[0] : 1;
+                term_materialize(term, term->cursor_y, TERM_COLS);
+                term_split_wide(term, term->cursor_y, term->cursor_x);
+                term_split_wide(term, term->cursor_y, TERM_COLS - count);
                 for (int x = TERM_COLS - 1; x >= term->cursor_x + count; x--) {
-                    term->cells[term->cursor_y][x] = term->cells[term->cursor_y][x - count];
-                }
-                for (int x = term->cursor_x; x < term->cursor_x + count && x < TERM_COLS; x++) {
-                    term->cells[term->cursor_y][x].codepoint = ' ';
-                    term->cells[term->cursor_y][x].fg_color = term->fg_color;
-                    term->cells[term->cursor_y][x].bg_color = term->bg_color;
+                    term_row(term, term->cursor_y)[x] = term_row(term, term->cursor_y)[x - count];
                 }
+                term_clear_cells(term, term->cursor_y, term->cursor_x,
+                                 term->cursor_x + count < TERM_COLS ? term->cursor_x + count : TERM_COLS);
+                term_damage(term, term->cursor_y, term->cursor_x, TERM_COLS);
             }
             break;
 
@@ -728,6 +3931,13 @@ void term_handle_csi(struct terminal *term, char final) {
             }
             break;
 
+        case 'q': /* DECSCUSR - Set Cursor Style (CSI Ps SP q) */
+            if (term->intermediate == ' ') {
+                int style = n > 0 ? p[0] : 0;
+                if (style <= 6) term->cursor_style = style;
+            }
+            break;
+
         case 'c': /* Device Attributes (DA) */
             /* Respond as VT100 */
             if (term->master_fd >= 0) {
@@ -743,6 +3953,8 @@ void term_handle_csi(struct terminal *term, char final) {
 }
 
 void term_process_char(struct terminal *term, unsigned char ch) {
+    if (term->view_offset > 0) term_view_scroll(term, -term->view_offset);
+
     switch (term->state) {
         case STATE_NORMAL:
             if (ch == '\033') {
@@ -797,6 +4009,7 @@ void term_process_char(struct terminal *term, unsigned char ch) {
                 term->state = STATE_CSI;
                 term->num_escape_params = 0;
                 term->private_mode = 0;
+                term->intermediate = 0;
                 memset(term->escape_params, 0, sizeof(term->escape_params));
                 term->escape_buf_len = 0;
             } else if (ch == ']') {
@@ -805,6 +4018,12 @@ void term_process_char(struct terminal *term, unsigned char ch) {
             } else if (ch == '(' || ch == ')') {
                 /* Character set selection - ignore next char */
                 term->state = STATE_ESC_IGNORE;
+            } else if (ch == '7') {
+                term_save_cursor(term);
+                term->state = STATE_NORMAL;
+            } else if (ch == '8') {
+                term_restore_cursor(term);
+                term->state = STATE_NORMAL;
             } else {
                 /* Unknown escape - return to normal */
                 term->state = STATE_NORMAL;
@@ -835,7 +4054,8 @@ void term_process_char(struct terminal *term, unsigned char ch) {
                 term->state = STATE_NORMAL;
                 term->private_mode = 0;
             } else if (ch >= 0x20 && ch <= 0x2F) {
-                /* Intermediate characters - ignore for now */
+                /* Intermediate characters - only the last one matters to us */
+                term->intermediate = (char)ch;
             } else {
                 /* Invalid sequence - reset */
                 term->state = STATE_NORMAL;
@@ -855,45 +4075,297 @@ void term_process_char(struct terminal *term, unsigned char ch) {
     }
 }
 
-void term_render(struct framebuffer *fb, struct terminal *term,
-                 struct font_entry *fonts, int num_fonts,
-                 float scale, int baseline, int char_width, int char_height) {
+/*
+ * Draw columns [x0[y], x1[y]) of rows y0..y1-1. Each run of cells with
+ * the same background is cleared with one fill, then only cells with
+ * ink are blitted, so blank and solid-colored areas cost one span per
+ * pixel row. Glyphs are clipped to their cells, so filling a whole run
+ * first draws the same pixels as going cell by cell.
+ */
+static void term_render_rows(struct framebuffer *fb, struct terminal *term, struct glyph_cache *cache,
+                             const int *x0, const int *x1, int y0, int y1,
+                             int char_width, int char_height) {
+    for (int y = y0; y < y1; y++) {
+        struct cell *row = term_display_row(term, y);
+        const struct row_info *info = term_display_info(term, y);
+        int py = y * char_height;
+        int cells_x1 = x1[y] < info->blank_from ? x1[y] : info->blank_from;
+
+        /* The blank tail is a single fill */
+        if (x1[y] > info->blank_from) {
+            int x = x0[y] > info->blank_from ? x0[y] : info->blank_from;
+            fb_fill_rect(fb, x * char_width, py, (x1[y] - x) * char_width, char_height,
+                         attr_bg(&term->attrs[info->blank_attr]));
+        }
 
-    for (int y = 0; y < TERM_ROWS; y++) {
-        for (int x = 0; x < TERM_COLS; x++) {
-            struct cell *cell = &term->cells[y][x];
+        for (int x = x0[y]; x < cells_x1; ) {
+            uint32_t run_attr = row[x].attr;
+            uint32_t bg_color = attr_bg(&term->attrs[run_attr]);
+            int end = x + 1;
+            while (end < cells_x1 && (row[end].attr == run_attr ||
+                                   attr_bg(&term->attrs[row[end].attr]) == bg_color)) end++;
+
+            fb_fill_rect(fb, x * char_width, py, (end - x) * char_width, char_height, bg_color);
+            for (; x < end; x++) {
+                const struct attr *attr = &term->attrs[row[x].attr];
+                /* A wide glyph is clipped to both its cells, which are
+                 * always damaged together */
+                int glyph_width = x + 1 < cells_x1 && row[x + 1].codepoint == CELL_CONTINUATION ?
+                                  2 * char_width : char_width;
+                if (render_glyph(fb, cache, row[x].codepoint, attr->flags & ATTR_BOLD, x * char_width, py,
+                                 attr_fg(attr), bg_color, glyph_width, char_height)) {
+                    if (term->stub_x1[y] <= term->stub_x0[y]) {
+                        term->stub_x0[y] = x;
+                        term->stub_x1[y] = x + 1;
+                    } else {
+                        if (x < term->stub_x0[y]) term->stub_x0[y] = x;
+                        if (x + 1 > term->stub_x1[y]) term->stub_x1[y] = x + 1;
+                    }
+                }
+                if (attr->flags & ATTR_UNDERLINE) {
+                    int thickness = char_height / 14 > 1 ? char_height / 14 : 1;
+                    fb_fill_rect(fb, x * char_width, py + char_height - 2 * thickness,
+                                 char_width, thickness, attr_fg(attr));
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Render worker pool
+ *
+ * A big repaint is mostly glyph rasterization and blending, and cells in
+ * different rows touch disjoint pixel rows of the back buffer. So the
+ * screen is cut into bands of rows that the workers, and the thread
+ * calling term_render(), claim until none are left. Damage, scrolling
+ * and the cursor stay on the calling thread.
+ */
+#define RENDER_PARALLEL_MIN_CELLS 1024  /* Smaller repaints stay on one thread */
+#define RENDER_BANDS_PER_THREAD   4     /* Slack for unevenly damaged screens */
+
+struct render_pool {
+    pthread_t threads[MAX_RENDER_THREADS];
+    int num_threads;           /* Including the thread calling term_render() */
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    unsigned long generation;  /* Bumped for every job */
+    int busy;                  /* Workers still on the current job */
+    int shutdown;
+
+    /* Current job */
+    struct framebuffer *fb;
+    struct terminal *term;
+    struct glyph_cache *cache;
+    const int *x0, *x1;
+    int char_width, char_height;
+    int band_rows;
+    int num_bands;
+    int next_band;
+};
+
+static void render_pool_bands(struct render_pool *pool) {
+    for (;;) {
+        int band = __atomic_fetch_add(&pool->next_band, 1, __ATOMIC_RELAXED);
+        if (band >= pool->num_bands) break;
+
+        int y0 = band * pool->band_rows;
+        int y1 = y0 + pool->band_rows < TERM_ROWS ? y0 + pool->band_rows : TERM_ROWS;
+        term_render_rows(pool->fb, pool->term, pool->cache, pool->x0, pool->x1, y0, y1,
+                         pool->char_width, pool->char_height);
+    }
+}
+
+static void *render_worker(void *arg) {
+    struct render_pool *pool = arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->shutdown && pool->generation == seen) {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (pool->shutdown) break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
 
-            int px = x * char_width;
-            int py = y * char_height;
+        render_pool_bands(pool);
 
-            render_char(fb, fonts, num_fonts, cell->codepoint, px, py,
-                       scale, baseline, cell->fg_color, cell->bg_color,
-                       char_width, char_height);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Start threads - 1 workers; falls back to fewer if creation fails */
+void render_pool_init(struct render_pool *pool, int threads) {
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->num_threads = 1;
+
+    if (threads > MAX_RENDER_THREADS) threads = MAX_RENDER_THREADS;
+
+    /* Workers inherit a full signal mask so SIGCHLD and SIGWINCH keep
+     * interrupting the main loop's select() */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (int i = 0; i < threads - 1; i++) {
+        if (pthread_create(&pool->threads[i], NULL, render_worker, pool) != 0) break;
+        pool->num_threads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void render_pool_destroy(struct render_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->num_threads - 1; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+    pool->num_threads = 1;
+}
+
+static void render_pool_run(struct render_pool *pool, struct framebuffer *fb, struct terminal *term,
+                            struct glyph_cache *cache, const int *x0, const int *x1,
+                            int char_width, int char_height) {
+    int bands = pool->num_threads * RENDER_BANDS_PER_THREAD;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fb = fb;
+    pool->term = term;
+    pool->cache = cache;
+    pool->x0 = x0;
+    pool->x1 = x1;
+    pool->char_width = char_width;
+    pool->char_height = char_height;
+    pool->band_rows = (TERM_ROWS + bands - 1) / bands;
+    pool->num_bands = (TERM_ROWS + pool->band_rows - 1) / pool->band_rows;
+    pool->next_band = 0;
+    pool->busy = pool->num_threads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    render_pool_bands(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Placeholder spans follow their cells through a pixel move */
+static void term_scroll_stubs(struct terminal *term) {
+    int top = term->move_top, bottom = term->move_bottom, lines = term->move_lines;
+    if (lines > 0) {
+        for (int y = top; y <= bottom; y++) {
+            int from = y + lines;
+            term->stub_x0[y] = from <= bottom ? term->stub_x0[from] : 0;
+            term->stub_x1[y] = from <= bottom ? term->stub_x1[from] : 0;
+        }
+    } else {
+        for (int y = bottom; y >= top; y--) {
+            int from = y + lines;
+            term->stub_x0[y] = from >= top ? term->stub_x0[from] : 0;
+            term->stub_x1[y] = from >= top ? term->stub_x1[from] : 0;
         }
     }
 }
 
+/* pool may be NULL to render on the calling thread only */
+void term_render(struct framebuffer *fb, struct terminal *term, struct glyph_cache *cache,
+                 struct render_pool *pool, int char_width, int char_height) {
+
+    /* Scrolls become a move of the already-rendered pixel rows */
+    if (term->move_lines != 0) {
+        fb_scroll_rect(fb, 0, term->move_top * char_height, TERM_COLS * char_width,
+                       (term->move_bottom - term->move_top + 1) * char_height,
+                       term->move_lines * char_height);
+
+        /* The cursor overlay's pixels moved too, or were scrolled away */
+        if (term->drawn_cursor_y >= term->move_top && term->drawn_cursor_y <= term->move_bottom) {
+            term->drawn_cursor_y -= term->move_lines;
+            if (term->drawn_cursor_y < term->move_top || term->drawn_cursor_y > term->move_bottom) {
+                term->drawn_cursor_y = -1;
+                term->drawn_cursor_shape = CURSOR_NONE;
+            }
+        }
+        term_scroll_stubs(term);
+        term->move_lines = 0;
+    }
 
-static int codepoint_to_utf8(uint32_t cp, char *buf) {
-    if (cp < 0x80) {
-        buf[0] = (char)cp;
-        return 1;
-    } else if (cp < 0x800) {
-        buf[0] = (char)(0xC0 | (cp >> 6));
-        buf[1] = (char)(0x80 | (cp & 0x3F));
-        return 2;
-    } else if (cp < 0x10000) {
-        buf[0] = (char)(0xE0 | (cp >> 12));
-        buf[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
-        buf[2] = (char)(0x80 | (cp & 0x3F));
-        return 3;
+    /* Glyphs finished in the background replace their placeholders */
+    unsigned long ready = __atomic_load_n(&cache->ready, __ATOMIC_ACQUIRE);
+    if (ready != term->glyphs_ready) {
+        term->glyphs_ready = ready;
+        for (int y = 0; y < TERM_ROWS; y++) {
+            if (term->stub_x1[y] > term->stub_x0[y]) {
+                term_damage(term, y, term->stub_x0[y], term->stub_x1[y]);
+                term->stub_x0[y] = term->stub_x1[y] = 0;
+            }
+        }
+    }
+
+    /* Only the cells the cursor leaves and enters are repainted when it
+     * moves, changes shape or blinks */
+    double now = monotonic_now();
+    if (term->cursor_x != term->drawn_cursor_x || term->cursor_y != term->drawn_cursor_y) {
+        term->cursor_blink_epoch = now;
+    }
+    int cursor_shape = term_cursor_shape(term, now);
+    term_damage_cursor(term, cursor_shape);
+
+    /* Take this frame's spans and record their pixel damage up front, so
+     * the drawing itself can be spread over the pool */
+    int x0[MAX_TERM_ROWS], x1[MAX_TERM_ROWS];
+    int cells = 0;
+    for (int y = 0; y < TERM_ROWS; y++) {
+        x0[y] = term->dirty_x0[y];
+        x1[y] = term->dirty_x1[y];
+        if (x1[y] <= x0[y]) {
+            x0[y] = x1[y] = 0;
+            continue;
+        }
+        term_damage_clear(term, y);
+        term_widen_span(term, y, &x0[y], &x1[y]);
+        cells += x1[y] - x0[y];
+        fb_damage(fb, x0[y] * char_width, y * char_height, (x1[y] - x0[y]) * char_width, char_height);
+    }
+
+    if (pool && pool->num_threads > 1 && cells >= RENDER_PARALLEL_MIN_CELLS) {
+        render_pool_run(pool, fb, term, cache, x0, x1, char_width, char_height);
     } else {
-        buf[0] = (char)(0xF0 | (cp >> 18));
-        buf[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
-        buf[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
-        buf[3] = (char)(0x80 | (cp & 0x3F));
-        return 4;
+        term_render_rows(fb, term, cache, x0, x1, 0, TERM_ROWS, char_width, char_height);
+    }
+
+    /* The overlay is gone wherever its cell was just repainted */
+    int cx = term->cursor_x, cy = term->cursor_y;
+    if (cursor_shape != CURSOR_NONE && cy < TERM_ROWS && cx < TERM_COLS &&
+        cx >= x0[cy] && cx < x1[cy]) {
+        /* On either half of a wide character the cursor covers both */
+        int cursor_width = term_cell_width(term, cy, cx);
+        if (cursor_width == 0) {
+            cx--;
+            cursor_width = 2;
+        }
+        struct cell cell = row_cell(term_display_row(term, cy), term_display_info(term, cy), cx);
+        render_cursor(fb, cache, &cell, &term->attrs[cell.attr], cursor_shape,
+                      cx * char_width, cy * char_height, cursor_width * char_width, char_height);
     }
+
+    glyph_cache_trim(cache);
 }
 
 void term_render_ansi(struct terminal *term) {
@@ -916,36 +4388,58 @@ void term_render_ansi(struct terminal *term) {
     /* Hide cursor during render to prevent flicker */
     ANSI_EMIT("\033[?25l", 6);
 
-    uint32_t last_fg = 0xFFFFFFFF;
-    uint32_t last_bg = 0xFFFFFFFF;
+    uint32_t last_attr = MAX_ATTRS;  /* None yet */
+
+    term_damage_flatten_scroll(term);
+    term_damage_cursor(term, CURSOR_BLOCK);
 
     for (int y = 0; y < TERM_ROWS; y++) {
-        /* Position cursor at start of row */
+        int x0 = term->dirty_x0[y];
+        int x1 = term->dirty_x1[y];
+        if (x1 <= x0) continue;
+        term_damage_clear(term, y);
+        term_widen_span(term, y, &x0, &x1);
+
+        /* Position cursor at start of the damaged span */
         char pos[24];
-        int poslen = snprintf(pos, sizeof(pos), "\033[%d;1H", y + 1);
+        int poslen = snprintf(pos, sizeof(pos), "\033[%d;%dH", y + 1, x0 + 1);
         ANSI_EMIT(pos, poslen);
 
-        for (int x = 0; x < TERM_COLS; x++) {
-            struct cell *cell = &term->cells[y][x];
+        const struct row_info *info = term_display_info(term, y);
+        for (int x = x0; x < x1; x++) {
+            struct cell cell = row_cell(term_display_row(term, y), info, x);
 
-            /* Emit combined fg+bg color change only when needed */
-            if (cell->fg_color != last_fg || cell->bg_color != last_bg) {
-                char color[72];
+            /* Emit a combined SGR only when the attributes change */
+            if (cell.attr != last_attr) {
+                const struct attr *a = &term->attrs[cell.attr];
+                char color[80];
                 int clen = snprintf(color, sizeof(color),
-                    "\033[38;2;%d;%d;%d;48;2;%d;%d;%dm",
-                    (cell->fg_color >> 16) & 0xFF,
-                    (cell->fg_color >> 8)  & 0xFF,
-                     cell->fg_color        & 0xFF,
-                    (cell->bg_color >> 16) & 0xFF,
-                    (cell->bg_color >> 8)  & 0xFF,
-                     cell->bg_color        & 0xFF);
+                    "\033[0%s%s%s;38;2;%d;%d;%d;48;2;%d;%d;%dm",
+                    (a->flags & ATTR_BOLD) ? ";1" : "",
+                    (a->flags & ATTR_UNDERLINE) ? ";4" : "",
+                    (a->flags & ATTR_INVERSE) ? ";7" : "",
+                    (a->fg_color >> 16) & 0xFF,
+                    (a->fg_color >> 8)  & 0xFF,
+                     a->fg_color        & 0xFF,
+                    (a->bg_color >> 16) & 0xFF,
+                    (a->bg_color >> 8)  & 0xFF,
+                     a->bg_color        & 0xFF);
                 ANSI_EMIT(color, clen);
-                last_fg = cell->fg_color;
-                last_bg = cell->bg_color;
+                last_attr = cell.attr;
             }
 
+            /* The blank tail is erased to the end of the line, in its
+             * colors, with one EL */
+            if (x >= info->blank_from) {
+                ANSI_EMIT("\033[K", 3);
+                break;
+            }
+
+            /* The terminal moves past both halves of a wide character */
+            if (cell.codepoint == CELL_CONTINUATION) continue;
+
             /* Encode codepoint as UTF-8 and emit */
-            uint32_t cp = cell->codepoint ? cell->codepoint : ' ';
+            uint32_t cp = cell.codepoint ? cell.codepoint : ' ';
             char utf8[4];
             int utf8len = codepoint_to_utf8(cp, utf8);
             ANSI_EMIT(utf8, utf8len);
@@ -956,13 +4450,15 @@ void term_render_ansi(struct terminal *term) {
      * readline hides/shows it during redraws and we may catch it hidden.
      * Use standard ANSI yellow bg + black fg: universally visible, no
      * truecolor needed. */
-    if (term->cursor_y < TERM_ROWS && term->cursor_x < TERM_COLS) {
-        struct cell *cc = &term->cells[term->cursor_y][term->cursor_x];
+    if (term->cursor_y < TERM_ROWS && term->cursor_x < TERM_COLS && term->view_offset == 0) {
+        int cx = term->cursor_x;
+        if (term_cell_width(term, term->cursor_y, cx) == 0) cx--;
+        struct cell cc = row_cell(term_row(term, term->cursor_y), term_row_info(term, term->cursor_y), cx);
         char cur[40];
         int curlen = snprintf(cur, sizeof(cur), "\033[%d;%dH\033[0m\033[30;43m",
-            term->cursor_y + 1, term->cursor_x + 1);
+            term->cursor_y + 1, cx + 1);
         ANSI_EMIT(cur, curlen);
-        uint32_t cp = cc->codepoint ? cc->codepoint : ' ';
+        uint32_t cp = cc.codepoint ? cc.codepoint : ' ';
         char utf8[4];
         int utf8len = codepoint_to_utf8(cp, utf8);
         ANSI_EMIT(utf8, utf8len);
@@ -981,6 +4477,374 @@ void term_render_ansi(struct terminal *term) {
     }
 }
 
+/*
+ * Render thread (framebuffer mode)
+ *
+ * The main loop only parses: it drains the PTY and stdin and applies
+ * bytes to its terminal under rt->lock. The render thread takes the lock
+ * just long enough to pull the damaged rows into its own snapshot, then
+ * rasterizes and presents without it, so a slow frame or a vsync wait
+ * never holds up the shell's output or the keyboard.
+ */
+struct render_thread {
+    pthread_t thread;
+    pthread_mutex_t lock;  /* Guards term and the flags below */
+    pthread_cond_t cond;
+    pthread_cond_t idle_cond;  /* Signalled when a frame is done */
+    int pending;           /* term changed since the last snapshot */
+    int redraw;            /* Background glyphs are ready for their cells */
+    int paused;            /* Display switched away: don't touch fb */
+    int busy;              /* A frame is being drawn */
+    int stop;
+
+    struct terminal *term;      /* Parser's grid */
+    struct terminal *snapshot;  /* Render thread's copy */
+    struct framebuffer *fb;
+    struct glyph_cache *cache;
+    struct render_pool *pool;
+    int char_width, char_height;
+};
+
+static void *render_thread_main(void *arg) {
+    struct render_thread *rt = arg;
+    double last_frame = 0.0;
+
+    pthread_mutex_lock(&rt->lock);
+    for (;;) {
+        /* Sleep until there is new output or the cursor blinks */
+        int blink = 0;
+        while (!rt->stop && (rt->paused || (!rt->pending && !rt->redraw && !blink))) {
+            double deadline = rt->paused ? 0.0 : term_cursor_deadline(rt->snapshot, monotonic_now());
+            if (deadline == 0.0) {
+                pthread_cond_wait(&rt->cond, &rt->lock);
+                continue;
+            }
+            struct timespec ts;
+            ts.tv_sec = (time_t)deadline;
+            ts.tv_nsec = (long)((deadline - ts.tv_sec) * 1e9);
+            blink = pthread_cond_timedwait(&rt->cond, &rt->lock, &ts) == ETIMEDOUT;
+        }
+        if (rt->stop) break;
+
+        /* Without vsync, cap at ~60fps; output arriving meanwhile is
+         * folded into the next snapshot */
+        double wait = last_frame + 0.016666 - monotonic_now();
+        if (!rt->fb->vsync && wait > 0) {
+            pthread_mutex_unlock(&rt->lock);
+            struct timespec ts = { 0, (long)(wait * 1e9) };
+            nanosleep(&ts, NULL);
+            pthread_mutex_lock(&rt->lock);
+            continue;
+        }
+
+        rt->redraw = 0;
+        if (rt->pending) {
+            rt->pending = 0;
+            term_snapshot(rt->snapshot, rt->term);
+        }
+        rt->busy = 1;
+        pthread_mutex_unlock(&rt->lock);
+
+        term_render(rt->fb, rt->snapshot, rt->cache, rt->pool, rt->char_width, rt->char_height);
+        fb_flush(rt->fb);
+        last_frame = monotonic_now();
+
+        pthread_mutex_lock(&rt->lock);
+        rt->busy = 0;
+        pthread_cond_broadcast(&rt->idle_cond);
+    }
+    pthread_mutex_unlock(&rt->lock);
+    return NULL;
+}
+
+int render_thread_start(struct render_thread *rt, struct terminal *term, struct framebuffer *fb,
+                        struct glyph_cache *cache, struct render_pool *pool,
+                        int char_width, int char_height) {
+    memset(rt, 0, sizeof(*rt));
+    rt->snapshot = malloc(sizeof(*rt->snapshot));
+    if (!rt->snapshot) return -1;
+    if (term_clone(rt->snapshot, term) < 0) {
+        free(rt->snapshot);
+        return -1;
+    }
+    term_damage_all(rt->snapshot);
+
+    rt->term = term;
+    rt->fb = fb;
+    rt->cache = cache;
+    rt->pool = pool;
+    rt->char_width = char_width;
+    rt->char_height = char_height;
+    rt->pending = 1;
+    pthread_mutex_init(&rt->lock, NULL);
+
+    /* Blink deadlines come from monotonic_now() */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&rt->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&rt->idle_cond, NULL);
+
+    /* Signals stay with the main loop, as for the pool workers */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&rt->thread, NULL, render_thread_main, rt);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        pthread_cond_destroy(&rt->idle_cond);
+        pthread_cond_destroy(&rt->cond);
+        pthread_mutex_destroy(&rt->lock);
+        term_free(rt->snapshot);
+        free(rt->snapshot);
+        return -1;
+    }
+    return 0;
+}
+
+/* Tell the render thread term has changed */
+void render_thread_kick(struct render_thread *rt) {
+    pthread_mutex_lock(&rt->lock);
+    rt->pending = 1;
+    pthread_cond_signal(&rt->cond);
+    pthread_mutex_unlock(&rt->lock);
+}
+
+/* Glyph cache notify hook: repaint placeholders without new output */
+void render_thread_glyphs_ready(void *arg) {
+    struct render_thread *rt = arg;
+    pthread_mutex_lock(&rt->lock);
+    rt->redraw = 1;
+    pthread_cond_signal(&rt->cond);
+    pthread_mutex_unlock(&rt->lock);
+}
+
+/* Stop drawing (waiting out the frame in progress) or start again with
+ * whatever changed meanwhile */
+void render_thread_pause(struct render_thread *rt, int paused) {
+    pthread_mutex_lock(&rt->lock);
+    rt->paused = paused;
+    if (paused) {
+        while (rt->busy) pthread_cond_wait(&rt->idle_cond, &rt->lock);
+    } else {
+        rt->pending = 1;
+        pthread_cond_signal(&rt->cond);
+    }
+    pthread_mutex_unlock(&rt->lock);
+}
+
+/* Waits for the frame in progress, if any; a pending one is dropped */
+void render_thread_stop(struct render_thread *rt) {
+    pthread_mutex_lock(&rt->lock);
+    rt->stop = 1;
+    pthread_cond_signal(&rt->cond);
+    pthread_mutex_unlock(&rt->lock);
+
+    pthread_join(rt->thread, NULL);
+    pthread_cond_destroy(&rt->idle_cond);
+    pthread_cond_destroy(&rt->cond);
+    pthread_mutex_destroy(&rt->lock);
+    term_free(rt->snapshot);
+    free(rt->snapshot);
+}
+
+/*
+ * Microbenchmark (--bench): times the glyph blend kernels on an in-memory
+ * XRGB8888 surface, so it runs anywhere, framebuffer or not. Every kernel
+ * is checked against the scalar one before it is timed. Then the flush
+ * copies are timed on /dev/fb0 if it can be opened, since its
+ * write-combined mapping is what they are for, or on plain RAM if not.
+ */
+struct bench_kernel {
+    const char *name;
+    void (*blit)(struct framebuffer *fb, uint8_t *dst,
+                 const unsigned char *bitmap, int stride, int width, int height,
+                 uint32_t fg_color, uint32_t bg_color);
+};
+
+struct bench_copy {
+    const char *name;
+    void (*copy)(uint8_t *dst, const uint8_t *src, size_t len);
+};
+
+static void bench_flush(void) {
+    struct framebuffer fb = {0};
+    uint8_t *dst;
+    int on_device = fb_open(&fb, "/dev/fb0", 1) == 0;
+
+    if (on_device) {
+        dst = fb.mem;
+    } else {
+        fb.fd = -1;
+        fb.width = 1920;
+        fb.height = 1080;
+        fb.bpp = 32;
+        fb.line_length = fb.width * 4;
+        fb.vinfo.red.offset = 16;
+        fb.vinfo.green.offset = 8;
+        fb.vinfo.red.length = fb.vinfo.green.length = fb.vinfo.blue.length = 8;
+        fb_init_format(&fb);
+        fb.back_size = (size_t)fb.line_length * fb.height;
+        fb.back = malloc(fb.back_size);
+        fb.mem = malloc(fb.back_size);
+        if (!fb.back || !fb.mem) {
+            perror("malloc");
+            return;
+        }
+        dst = fb.mem;
+    }
+
+    struct bench_copy copies[4];
+    int num_copies = 0;
+    copies[num_copies++] = (struct bench_copy){ "pixel", copy_span_pixels };
+    copies[num_copies++] = (struct bench_copy){ "memcpy", copy_span_memcpy };
+#if defined(__x86_64__)
+    copies[num_copies++] = (struct bench_copy){ "sse2 stream", copy_span_stream_sse2 };
+    if (fb.copy_span == copy_span_stream_avx)
+        copies[num_copies++] = (struct bench_copy){ "avx stream", copy_span_stream_avx };
+#endif
+
+    size_t row_bytes = (size_t)fb.width * fb.bytes_pp;
+    int frames = 30;
+    printf("flush %dx%d %d bpp to %s, %d full frames (default: %s)\n",
+           fb.width, fb.height, fb.bpp, on_device ? "/dev/fb0" : "system RAM (no /dev/fb0)",
+           frames, fb.copy_name);
+
+    for (int k = 0; k < num_copies; k++) {
+        for (size_t i = 0; i < fb.back_size; i++) fb.back[i] = (uint8_t)(i * 7 + k);
+
+        double start = monotonic_now();
+        for (int f = 0; f < frames; f++) {
+            for (int y = 0; y < fb.height; y++) {
+                size_t offset = (size_t)y * fb.line_length;
+                copies[k].copy(dst + offset, fb.back + offset, row_bytes);
+            }
+#if defined(__x86_64__)
+            _mm_sfence();
+#endif
+        }
+        double elapsed = monotonic_now() - start;
+
+        int ok = 1;
+        for (int y = 0; y < fb.height && ok; y++) {
+            size_t offset = (size_t)y * fb.line_length;
+            ok = memcmp(dst + offset, fb.back + offset, row_bytes) == 0;
+        }
+        printf("%-12s %8.2f ms/frame %8.0f MB/s  %s\n", copies[k].name,
+               elapsed * 1e3 / frames, row_bytes * fb.height * (double)frames / elapsed / 1e6,
+               ok ? "ok" : "MISMATCH");
+    }
+
+    if (on_device) {
+        /* Leave the console black rather than showing the test pattern */
+        memset(fb.back, 0, fb.back_size);
+        fb.copy_span(fb.mem, fb.back, fb.back_size);
+        fb_close(&fb);
+    } else {
+        free(fb.back);
+        free(fb.mem);
+    }
+}
+
+int run_bench(const char *font_path, float font_size) {
+    struct font_entry font;
+    if (load_font(&font, font_path, "Primary") != 0) {
+        fprintf(stderr, "Failed to load font %s\n", font_path);
+        return 1;
+    }
+
+    float scale = stbtt_ScaleForPixelHeight(&font.info, font_size);
+    int ascent, descent, line_gap;
+    stbtt_GetFontVMetrics(&font.info, &ascent, &descent, &line_gap);
+    struct glyph_cache cache;
+    glyph_cache_init(&cache, &font, 1, scale, (int)(ascent * scale));
+
+    struct framebuffer fb = {0};
+    fb.fd = -1;
+    fb.width = 1024;
+    fb.height = 768;
+    fb.bpp = 32;
+    fb.line_length = fb.width * 4;
+    fb.vinfo.red.offset = 16;
+    fb.vinfo.green.offset = 8;
+    fb.vinfo.red.length = fb.vinfo.green.length = fb.vinfo.blue.length = 8;
+    fb_init_format(&fb);
+    fb.back_size = (size_t)fb.line_length * fb.height;
+    fb.back = calloc(1, fb.back_size);
+    uint8_t *ref = malloc(fb.back_size);
+    if (!fb.back || !ref) {
+        perror("malloc");
+        return 1;
+    }
+
+    struct glyph *glyphs[95];
+    int num_glyphs = 0;
+    for (uint32_t c = 33; c <= 126; c++) {
+        struct glyph *g = glyph_cache_lookup(&cache, c, GLYPH_STYLE_REGULAR);
+        if (g && g->bitmap) glyphs[num_glyphs++] = g;
+    }
+
+    static const uint32_t pairs[][2] = {
+        { 0x00FFFFFF, 0x00000000 }, { 0x00CDCD00, 0x00000000 },
+        { 0x00E5E5E5, 0x000000EE }, { 0x00000000, 0x00CD0000 },
+    };
+    int num_pairs = sizeof(pairs) / sizeof(pairs[0]);
+
+    struct bench_kernel kernels[4];
+    int num_kernels = 0;
+    kernels[num_kernels++] = (struct bench_kernel){ "scalar", blit_glyph_xrgb32 };
+    kernels[num_kernels++] = (struct bench_kernel){ "lut", blit_glyph_lut32 };
+#if defined(__x86_64__)
+    kernels[num_kernels++] = (struct bench_kernel){ "sse2", blit_glyph_xrgb32_sse2 };
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        kernels[num_kernels++] = (struct bench_kernel){ "avx2", blit_glyph_xrgb32_avx2 };
+#endif
+
+    int cols = fb.width / 32;
+    int iterations = 20000;
+    printf("%d glyphs at %.0fpx, %d iterations\n", num_glyphs, font_size, iterations);
+
+    for (int k = 0; k < num_kernels; k++) {
+        /* Correctness: one pass over a patterned background */
+        for (size_t i = 0; i < fb.back_size; i++) fb.back[i] = (uint8_t)(i * 7);
+        for (int n = 0; n < num_glyphs; n++) {
+            struct glyph *g = glyphs[n];
+            kernels[k].blit(&fb, fb.back + (n / cols) * 40 * fb.line_length + (n % cols) * 32 * 4,
+                            g->bitmap, g->width, g->width, g->height,
+                            pairs[n % num_pairs][0], pairs[n % num_pairs][1]);
+        }
+        if (k == 0) {
+            memcpy(ref, fb.back, fb.back_size);
+        }
+        int ok = memcmp(ref, fb.back, fb.back_size) == 0;
+
+        double start = monotonic_now();
+        for (int it = 0; it < iterations; it++) {
+            for (int n = 0; n < num_glyphs; n++) {
+                struct glyph *g = glyphs[n];
+                int pair = (n + it) % num_pairs;
+                kernels[k].blit(&fb, fb.back + (n / cols) * 40 * fb.line_length + (n % cols) * 32 * 4,
+                                g->bitmap, g->width, g->width, g->height,
+                                pairs[pair][0], pairs[pair][1]);
+            }
+        }
+        double elapsed = monotonic_now() - start;
+
+        printf("%-8s %8.1f ns/glyph  %s\n", kernels[k].name,
+               elapsed * 1e9 / ((double)iterations * num_glyphs), ok ? "ok" : "MISMATCH");
+    }
+
+    glyph_cache_free(&cache);
+    free(ref);
+    free(fb.back);
+    font_free(&font);
+
+    bench_flush();
+    return 0;
+}
+
 int spawn_shell(int *master_fd, int cols, int rows) {
     struct winsize ws = {
         .ws_row = rows,
@@ -1036,14 +4900,109 @@ void sigwinch_handler(int sig) {
     terminal_resized = 1;
 }
 
+/*
+ * VT switching
+ *
+ * In framebuffer mode the VT is put in KD_GRAPHICS, so fbcon neither
+ * draws nor blinks its cursor over us, and in VT_PROCESS mode, so a
+ * switch away waits for us: the kernel raises SIGUSR1, the main loop
+ * stops rendering and releases the display, then acknowledges with
+ * VT_RELDISP. SIGUSR2 brings us back for a full repaint.
+ */
+volatile sig_atomic_t vt_release_requested = 0;
+volatile sig_atomic_t vt_acquire_requested = 0;
+
+struct vt_state {
+    int fd;              /* The VT we run on, -1 if not on one */
+    int active;          /* We own the display */
+    struct vt_mode orig_mode;
+    int orig_kd_mode;
+};
+
+void sigusr1_handler(int sig) {
+    (void)sig;
+    vt_release_requested = 1;
+}
+
+void sigusr2_handler(int sig) {
+    (void)sig;
+    vt_acquire_requested = 1;
+}
+
+/* Take over the VT on fd if it is one; vt->active is set either way */
+void vt_setup(struct vt_state *vt, int fd) {
+    vt->fd = -1;
+    vt->active = 1;
+    if (ioctl(fd, VT_GETMODE, &vt->orig_mode) < 0 ||
+        ioctl(fd, KDGETMODE, &vt->orig_kd_mode) < 0) {
+        return;
+    }
+
+    signal(SIGUSR1, sigusr1_handler);
+    signal(SIGUSR2, sigusr2_handler);
+    struct vt_mode mode = {0};
+    mode.mode = VT_PROCESS;
+    mode.relsig = SIGUSR1;
+    mode.acqsig = SIGUSR2;
+    if (ioctl(fd, VT_SETMODE, &mode) < 0) {
+        signal(SIGUSR1, SIG_DFL);
+        signal(SIGUSR2, SIG_DFL);
+        return;
+    }
+    ioctl(fd, KDSETMODE, KD_GRAPHICS);
+    vt->fd = fd;
+}
+
+void vt_restore(struct vt_state *vt) {
+    if (vt->fd < 0) return;
+    ioctl(vt->fd, KDSETMODE, vt->orig_kd_mode);
+    ioctl(vt->fd, VT_SETMODE, &vt->orig_mode);
+    vt->fd = -1;
+}
+
 int main(int argc, char **argv) {
     int force_term = 0;
+    int bench = 0;
+    int render_threads = 0;
+    const char *device = NULL;
+    int rotate = -1;
+    const char *prewarm = NULL;
+    size_t scrollback_bytes = DEFAULT_SCROLLBACK_BYTES;
     const char *font_path = NULL;
     float user_font_size = 0.0f;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--term") == 0) {
             force_term = 1;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench = 1;
+        } else if (strcmp(argv[i], "--device") == 0 && i + 1 < argc) {
+            device = argv[++i];
+        } else if (strcmp(argv[i], "--rotate") == 0 && i + 1 < argc) {
+            rotate = atoi(argv[++i]);
+            if (rotate != 0 && rotate != 90 && rotate != 180 && rotate != 270) {
+                fprintf(stderr, "Rotation must be 0, 90, 180 or 270\n");
+                return 1;
+            }
+            rotate /= 90;
+        } else if (strcmp(argv[i], "--prewarm") == 0 && i + 1 < argc) {
+            prewarm = argv[++i];
+        } else if (strcmp(argv[i], "--scrollback") == 0 && i + 1 < argc) {
+            char *end;
+            unsigned long long bytes = strtoull(argv[++i], &end, 10);
+            if (*end == 'k' || *end == 'K') bytes <<= 10, end++;
+            else if (*end == 'm' || *end == 'M') bytes <<= 20, end++;
+            if (*end != '\0' || bytes > (1ULL << 30)) {
+                fprintf(stderr, "Scrollback must be a byte count up to 1G, with an optional K or M suffix\n");
+                return 1;
+            }
+            scrollback_bytes = bytes;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            render_threads = atoi(argv[++i]);
+            if (render_threads < 1 || render_threads > MAX_RENDER_THREADS) {
+                fprintf(stderr, "Thread count must be between 1 and %d\n", MAX_RENDER_THREADS);
+                return 1;
+            }
         } else if (font_path == NULL) {
             font_path = argv[i];
         } else {
@@ -1055,6 +5014,14 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (bench) {
+        if (font_path == NULL) {
+            fprintf(stderr, "Usage: %s --bench font.ttf [font_size]\n", argv[0]);
+            return 1;
+        }
+        return run_bench(font_path, user_font_size > 0.0f ? user_font_size : 16.0f);
+    }
+
     init_color_palette();
 
     /* Determine render mode */
@@ -1062,9 +5029,12 @@ int main(int argc, char **argv) {
     fb.fd = -1;
 
     if (!force_term) {
-        /* Try to open framebuffer silently; fall back to terminal mode if unavailable */
-        if (fb_open(&fb, "/dev/fb0", 1) == 0) {
+        /* Try to open the display silently; fall back to terminal mode if
+         * unavailable. A device given explicitly has to work. */
+        if (output_open(&fb, device, device == NULL) == 0) {
             render_mode = RENDER_FB;
+        } else if (device) {
+            return 1;
         } else {
             render_mode = RENDER_TERM;
         }
@@ -1073,10 +5043,16 @@ int main(int argc, char **argv) {
     }
 
     if (render_mode == RENDER_FB && font_path == NULL) {
-        fprintf(stderr, "Usage: %s [--term] [font.ttf [font_size]]\n", argv[0]);
-        fprintf(stderr, "  --term    - Force ANSI terminal output mode\n");
-        fprintf(stderr, "  font.ttf  - TrueType font (required for framebuffer mode)\n");
-        fprintf(stderr, "  font_size - Font size in pixels, 6-72 (framebuffer mode only)\n");
+        fprintf(stderr, "Usage: %s [--term] [--device PATH] [--rotate DEG] [--threads N] [--prewarm RANGES] [--scrollback SIZE] [font.ttf [font_size]]\n", argv[0]);
+        fprintf(stderr, "  --term       - Force ANSI terminal output mode\n");
+        fprintf(stderr, "  --device     - /dev/dri/cardN (KMS) or /dev/fbN (default: /dev/fb0; /dev/dri/cardN opts into KMS)\n");
+        fprintf(stderr, "  --rotate     - Clockwise display rotation: 0, 90, 180, 270 (default: fbcon's)\n");
+        fprintf(stderr, "  --threads    - Render threads (default: number of online CPUs)\n");
+        fprintf(stderr, "  --prewarm    - Hex codepoint ranges to rasterize while idle, e.g. 4E00-9FFF,3040-30FF\n");
+        fprintf(stderr, "  --scrollback - History size in bytes, K/M suffixes accepted, 0 disables (default: 4M)\n");
+        fprintf(stderr, "  --bench      - Benchmark the glyph blitters and exit\n");
+        fprintf(stderr, "  font.ttf     - TrueType font (required for framebuffer mode)\n");
+        fprintf(stderr, "  font_size    - Font size in pixels, 6-72 (framebuffer mode only)\n");
         fb_close(&fb);
         return 1;
     }
@@ -1086,6 +5062,8 @@ int main(int argc, char **argv) {
     int num_fonts = 0;
     float scale = 0.0f;
     int baseline = 0, char_width = 8, char_height = 16;
+    struct glyph_cache glyph_cache;
+    struct render_pool render_pool;
 
     if (font_path != NULL) {
         if (load_font(&fonts[num_fonts], font_path, "Primary") == 0) {
@@ -1127,11 +5105,13 @@ int main(int argc, char **argv) {
         int max_advance = 0;
         for (int c = 32; c <= 126; c++) {
             int adv, lsb;
-            stbtt_GetCodepointHMetrics(&fonts[0].info, c, &adv, &lsb);
+            stbtt_GetGlyphHMetrics(&fonts[0].info, stbtt_FindGlyphIndex(&fonts[0].info, c), &adv, &lsb);
             if (adv > max_advance) max_advance = adv;
         }
         char_width = (int)(max_advance * scale) + 1;
 
+        fb_set_rotation(&fb, rotate >= 0 ? rotate : fbcon_rotation());
+
         TERM_COLS = (fb.width - 4) / char_width;
         TERM_ROWS = (fb.height - 4) / char_height;
         if (TERM_COLS < 40)  TERM_COLS = 40;
@@ -1142,6 +5122,19 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Terminal size: %dx%d (char %dx%d, screen %dx%d)\n",
                 TERM_COLS, TERM_ROWS, char_width, char_height, fb.width, fb.height);
 
+        glyph_cache_init(&glyph_cache, fonts, num_fonts, scale, baseline);
+        glyph_cache.rotate = fb.rotate;
+        if (prewarm && glyph_cache_set_prewarm(&glyph_cache, prewarm) < 0) {
+            fprintf(stderr, "Ignoring malformed --prewarm ranges: %s\n", prewarm);
+        }
+
+        if (render_threads == 0) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            render_threads = cpus < 1 ? 1 : cpus > MAX_RENDER_THREADS ? MAX_RENDER_THREADS : (int)cpus;
+        }
+        render_pool_init(&render_pool, render_threads);
+        fprintf(stderr, "Render threads: %d\n", render_pool.num_threads);
+
         fb_clear(&fb, 0x00000000);
     } else {
         /* Get terminal dimensions from parent terminal */
@@ -1162,17 +5155,31 @@ int main(int argc, char **argv) {
 
     /* Initialize terminal */
     struct terminal term;
-    term_init(&term);
+    if (term_init(&term) < 0 || scrollback_init(&term.history, scrollback_bytes) < 0) {
+        fprintf(stderr, "Failed to allocate the terminal grid\n");
+        if (render_mode == RENDER_FB) fb_close(&fb);
+        else write(STDOUT_FILENO, "\033[?1049l", 8);
+        return 1;
+    }
 
     /* Set up signal handlers */
     signal(SIGCHLD, sigchld_handler);
     if (render_mode == RENDER_TERM)
         signal(SIGWINCH, sigwinch_handler);
 
+    struct vt_state vt;
+    if (render_mode == RENDER_FB) {
+        vt_setup(&vt, STDIN_FILENO);
+    } else {
+        vt.fd = -1;
+        vt.active = 1;
+    }
+
     /* Spawn shell */
     int master_fd;
     pid_t shell_pid = spawn_shell(&master_fd, TERM_COLS, TERM_ROWS);
     if (shell_pid < 0) {
+        vt_restore(&vt);
         if (render_mode == RENDER_FB) fb_close(&fb);
         else write(STDOUT_FILENO, "\033[?1049l", 8);
         return 1;
@@ -1180,6 +5187,20 @@ int main(int argc, char **argv) {
 
     term.master_fd = master_fd;
 
+    /* Frames are drawn off the parsing thread when possible */
+    struct render_thread render_thread;
+    int render_threaded = 0;
+    if (render_mode == RENDER_FB) {
+        render_threaded = render_thread_start(&render_thread, &term, &fb, &glyph_cache,
+                                              &render_pool, char_width, char_height) == 0;
+    }
+    /* Glyph misses go to the background once something repaints their
+     * placeholders without new output */
+    if (render_threaded) {
+        glyph_raster_start(&glyph_cache, render_pool.num_threads > 1 ? 2 : 1,
+                           render_thread_glyphs_ready, &render_thread);
+    }
+
     /* Set stdin to raw mode */
     struct termios old_term;
     int stdin_is_tty = 0;
@@ -1198,14 +5219,29 @@ int main(int argc, char **argv) {
     struct timespec last_render_ts = {0, 0};
 
     while (running) {
+        /* VT switches: let go of the display only once nothing draws */
+        if (vt_release_requested) {
+            vt_release_requested = 0;
+            if (render_threaded) render_thread_pause(&render_thread, 1);
+            fb_suspend(&fb);
+            vt.active = 0;
+            ioctl(vt.fd, VT_RELDISP, 1);
+        }
+        if (vt_acquire_requested) {
+            vt_acquire_requested = 0;
+            ioctl(vt.fd, VT_RELDISP, VT_ACKACQ);
+            fb_resume(&fb);
+            vt.active = 1;
+            if (render_threaded) render_thread_pause(&render_thread, 0);
+            else needs_render = 1;
+        }
+
         /* Handle terminal resize (SIGWINCH) */
         if (terminal_resized && render_mode == RENDER_TERM) {
             terminal_resized = 0;
             struct winsize ws;
-            if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0) {
-                TERM_COLS = ws.ws_col < MAX_TERM_COLS ? ws.ws_col : MAX_TERM_COLS;
-                TERM_ROWS = ws.ws_row < MAX_TERM_ROWS ? ws.ws_row : MAX_TERM_ROWS;
-                term.scroll_bottom = TERM_ROWS - 1;
+            if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0 &&
+                term_resize(&term, ws.ws_col, ws.ws_row) == 0) {
                 struct winsize new_ws = { .ws_row = TERM_ROWS, .ws_col = TERM_COLS };
                 ioctl(master_fd, TIOCSWINSZ, &new_ws);
                 needs_render = 1;
@@ -1225,8 +5261,23 @@ int main(int argc, char **argv) {
         if (ret > 0) {
             if (FD_ISSET(STDIN_FILENO, &fds)) {
                 ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
-                if (n > 0) {
-                    write(master_fd, buf, n);
+                /* Shift+PgUp/PgDn page the view through the scrollback
+                 * by half a screen, as in xterm; other keys go to the shell */
+                ssize_t start = 0;
+                for (ssize_t i = 0; i + 6 <= n; i++) {
+                    int dir = memcmp(buf + i, "\033[5;2~", 6) == 0 ? 1 :
+                              memcmp(buf + i, "\033[6;2~", 6) == 0 ? -1 : 0;
+                    if (dir == 0) continue;
+                    if (i > start) write(master_fd, buf + start, i - start);
+                    if (render_threaded) pthread_mutex_lock(&render_thread.lock);
+                    term_view_scroll(&term, dir * (TERM_ROWS / 2 > 0 ? TERM_ROWS / 2 : 1));
+                    if (render_threaded) pthread_mutex_unlock(&render_thread.lock);
+                    needs_render = 1;
+                    i += 5;
+                    start = i + 1;
+                }
+                if (n > start) {
+                    write(master_fd, buf + start, n - start);
                 }
             }
 
@@ -1237,9 +5288,11 @@ int main(int argc, char **argv) {
                 while (bytes_this_iter < 65536) {
                     ssize_t n = read(master_fd, buf, sizeof(buf));
                     if (n > 0) {
+                        if (render_threaded) pthread_mutex_lock(&render_thread.lock);
                         for (ssize_t i = 0; i < n; i++) {
                             term_process_char(&term, buf[i]);
                         }
+                        if (render_threaded) pthread_mutex_unlock(&render_thread.lock);
                         needs_render = 1;
                         bytes_this_iter += (int)n;
                         if (n < (ssize_t)sizeof(buf)) break;
@@ -1254,16 +5307,28 @@ int main(int argc, char **argv) {
             }
         }
 
-        if (needs_render) {
+        /* Without a render thread, blinking is driven from here */
+        if (render_mode == RENDER_FB && !render_threaded) {
+            if (term_cursor_shape(&term, monotonic_now()) != term.drawn_cursor_shape) needs_render = 1;
+        }
+
+        if (needs_render && render_threaded) {
+            render_thread_kick(&render_thread);
+            needs_render = 0;
+        }
+
+        if (needs_render && vt.active) {
             /* Rate-limit to ~60fps using a real clock so fast output (yes, etc.)
              * doesn't flood the outer terminal with thousands of frames/sec. */
             struct timespec now;
             clock_gettime(CLOCK_MONOTONIC, &now);
             long elapsed_us = (now.tv_sec  - last_render_ts.tv_sec)  * 1000000L
                             + (now.tv_nsec - last_render_ts.tv_nsec) / 1000L;
-            if (elapsed_us >= 16666) {
+            /* With vsync, presentation itself paces the frames */
+            if (elapsed_us >= 16666 || (render_mode == RENDER_FB && fb.vsync)) {
                 if (render_mode == RENDER_FB) {
-                    term_render(&fb, &term, fonts, num_fonts, scale, baseline, char_width, char_height);
+                    term_render(&fb, &term, &glyph_cache, &render_pool, char_width, char_height);
+                    fb_flush(&fb);
                 } else {
                     term_render_ansi(&term);
                 }
@@ -1278,16 +5343,36 @@ int main(int argc, char **argv) {
         tcsetattr(STDIN_FILENO, TCSANOW, &old_term);
     }
 
+    if (render_threaded) {
+        glyph_raster_stop(&glyph_cache);
+        render_thread_stop(&render_thread);
+    }
+
     if (render_mode == RENDER_FB) {
-        fb_clear(&fb, 0x00000000);
+        /* Switched away, the screen belongs to another VT */
+        if (vt.active) {
+            fb_clear(&fb, 0x00000000);
+            fb_flush(&fb);
+        }
+        vt_restore(&vt);
+        /* Before fb_close(), which forgets the output was KMS */
+        fprintf(stderr, "Frames: %lu presented, %lu dropped (%s, %s)\n",
+                fb.frames_presented, fb.frames_dropped,
+                fb.is_drm ? "KMS page flipping" : fb.num_pages == 2 ? "page flipping" : "single buffer",
+                fb.vsync ? "vsync" : "no vsync");
         fb_close(&fb);
+        render_pool_destroy(&render_pool);
+        fprintf(stderr, "Glyph cache: %lu hits, %lu misses, %lu evictions\n",
+                glyph_cache.hits, glyph_cache.misses, glyph_cache.evictions);
+        glyph_cache_free(&glyph_cache);
     } else {
         /* Leave alternate screen, restore user's terminal */
         write(STDOUT_FILENO, "\033[0m\033[?25h\033[?1049l", 19);
     }
 
+    term_free(&term);
     for (int i = 0; i < num_fonts; i++) {
-        if (fonts[i].buffer) free(fonts[i].buffer);
+        font_free(&fonts[i]);
     }
 
     close(master_fd);
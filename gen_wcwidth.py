@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+"""Generate fb_wcwidth.h, the column width of every codepoint.
+
+Widths follow wcwidth(3) as glibc defines it: 2 for East Asian Wide
+and Fullwidth characters, 0 for combining marks, format characters and
+Hangul medial and final jamo, 1 otherwise. The data comes from
+Python's unicodedata, so the table matches the Unicode version of the
+Python running this script.
+
+The table has two stages: the high bits of a codepoint pick a 256
+codepoint block, and identical blocks are stored once, 2 bits per
+codepoint.
+
+    python3 gen_wcwidth.py > fb_wcwidth.h
+"""
+
+import unicodedata
+
+BLOCK_BITS = 8
+BLOCK_SIZE = 1 << BLOCK_BITS
+MAX_CODEPOINT = 0x110000
+
+# Unassigned codepoints in these ranges default to Wide (UAX #11)
+WIDE_RESERVED = [
+    (0x3400, 0x4DBF),
+    (0x4E00, 0x9FFF),
+    (0xF900, 0xFAFF),
+    (0x20000, 0x2FFFD),
+    (0x30000, 0x3FFFD),
+]
+
+# Shown wide by glibc although their East Asian Width is Ambiguous or
+# Neutral: circled numbers on black squares, Yijing hexagram symbols
+WIDE_EXTRA = [
+    (0x3248, 0x324F),
+    (0x4DC0, 0x4DFF),
+]
+
+# Format characters that are drawn, spanning the digits after them
+PREPENDED_CONCATENATION_MARKS = {
+    0x0600, 0x0601, 0x0602, 0x0603, 0x0604, 0x0605, 0x06DD, 0x070F,
+    0x0890, 0x0891, 0x08E2, 0x110BD, 0x110CD,
+}
+
+
+def width(cp):
+    ch = chr(cp)
+    category = unicodedata.category(ch)
+    if cp == 0x00AD or cp in PREPENDED_CONCATENATION_MARKS:
+        return 1  # Shown, unlike other format characters
+    if category in ('Mn', 'Me', 'Cf', 'Cc'):
+        return 0
+    if 0x1160 <= cp <= 0x11FF or 0xD7B0 <= cp <= 0xD7FF:
+        return 0  # Hangul jamo that join the syllable before them
+    if cp == 0x200B:
+        return 0
+    if unicodedata.east_asian_width(ch) in ('W', 'F'):
+        return 2
+    if any(lo <= cp <= hi for lo, hi in WIDE_EXTRA):
+        return 2
+    if category == 'Cn' and any(lo <= cp <= hi for lo, hi in WIDE_RESERVED):
+        return 2
+    return 1
+
+
+def main():
+    blocks = []
+    block_ids = {}
+    stage1 = []
+    for base in range(0, MAX_CODEPOINT, BLOCK_SIZE):
+        packed = bytearray(BLOCK_SIZE // 4)
+        for i in range(BLOCK_SIZE):
+            packed[i // 4] |= width(base + i) << (2 * (i % 4))
+        packed = bytes(packed)
+        if packed not in block_ids:
+            block_ids[packed] = len(blocks)
+            blocks.append(packed)
+        stage1.append(block_ids[packed])
+    assert len(blocks) <= 256
+
+    out = []
+    out.append('/* Generated by gen_wcwidth.py from Unicode %s; do not edit. */'
+               % unicodedata.unidata_version)
+    out.append('')
+    out.append('#define WCWIDTH_BLOCK_BITS %d' % BLOCK_BITS)
+    out.append('')
+    out.append('/* Codepoint >> WCWIDTH_BLOCK_BITS -> block in wcwidth_blocks */')
+    out.append('static const uint8_t wcwidth_stage1[%d] = {' % len(stage1))
+    for i in range(0, len(stage1), 16):
+        out.append('    ' + ' '.join('%d,' % b for b in stage1[i:i + 16]))
+    out.append('};')
+    out.append('')
+    out.append('/* 2 bits per codepoint, lowest first */')
+    out.append('static const uint8_t wcwidth_blocks[%d][%d] = {' % (len(blocks), BLOCK_SIZE // 4))
+    for block in blocks:
+        out.append('    {')
+        for i in range(0, len(block), 16):
+            out.append('        ' + ' '.join('0x%02x,' % b for b in block[i:i + 16]))
+        out.append('    },')
+    out.append('};')
+    print('\n'.join(out))
+
+
+if __name__ == '__main__':
+    main()